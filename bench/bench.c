@@ -0,0 +1,308 @@
+/*
+    Benchmark driver.
+
+    For every examples/grammarN.ebnf and every input size, generate an
+    input with `genrec -r', build a recognizer with `genrec -g -s', and time
+    the interpreter, the generated recognizer and the lexer alone (-t).
+    Each run is repeated and the results are written as CSV, one line per
+    (grammar, engine, size):
+
+        grammar,engine,bytes,tokens,runs,median_s,min_s,mb_s,mtok_s,max_rss_kb,instr_tok
+
+    instr_tok is left empty when perf_event_open() is not available.
+
+    usage: bench [ -n runs ] [ -s size,size,... ] [ -o file.csv ] [ grammar ... ]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#endif
+
+#define MAX_SIZES   16
+#define MAX_RUNS    64
+#define TMP_INPUT   "bench/input.tmp"
+#define TMP_REC     "bench/rec.tmp"
+
+static char *prog_name;
+static char *genrec = "./genrec";
+static char *cc = "cc";
+
+typedef struct {
+    double secs;
+    long max_rss;       /* KB */
+    int64_t instr;      /* -1 if unknown */
+    int status;
+} Run;
+
+#define DIE(...)                            \
+    do {                                    \
+        fprintf(stderr, "%s: ", prog_name); \
+        fprintf(stderr, __VA_ARGS__);       \
+        fprintf(stderr, "\n");              \
+        exit(EXIT_FAILURE);                 \
+    } while (0)
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static int perf_open(pid_t pid)
+{
+#ifdef __linux__
+    struct perf_event_attr pe;
+
+    memset(&pe, 0, sizeof(pe));
+    pe.type = PERF_TYPE_HARDWARE;
+    pe.size = sizeof(pe);
+    pe.config = PERF_COUNT_HW_INSTRUCTIONS;
+    pe.disabled = 1;
+    pe.enable_on_exec = 1;
+    pe.exclude_kernel = 1;
+    pe.exclude_hv = 1;
+    return (int)syscall(__NR_perf_event_open, &pe, pid, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+/* run argv with stdout to /dev/null */
+static Run run(char *argv[])
+{
+    Run r;
+    pid_t pid;
+    int sync[2], fd;
+    struct rusage ru;
+    double t;
+    char c;
+
+    if (pipe(sync) == -1)
+        DIE("pipe() failed");
+    if ((pid=fork()) == -1)
+        DIE("fork() failed");
+    if (pid == 0) {
+        close(sync[1]);
+        if (read(sync[0], &c, 1) != 1) /* wait until the counter is set up */
+            _exit(127);
+        if ((fd=open("/dev/null", O_WRONLY)) != -1)
+            dup2(fd, 1);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    close(sync[0]);
+    fd = perf_open(pid);
+    t = now();
+    if (write(sync[1], "", 1) != 1)
+        DIE("write() failed");
+    close(sync[1]);
+    if (wait4(pid, &r.status, 0, &ru) == -1)
+        DIE("wait4() failed");
+    r.secs = now()-t;
+    r.max_rss = ru.ru_maxrss;
+    r.instr = -1;
+    if (fd != -1) {
+        if (read(fd, &r.instr, sizeof(r.instr)) != sizeof(r.instr))
+            r.instr = -1;
+        close(fd);
+    }
+    return r;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x, y;
+
+    x = *(double *)a;
+    y = *(double *)b;
+    return (x > y)-(x < y);
+}
+
+static long parse_size(char *s, char **end)
+{
+    long n;
+
+    n = strtol(s, end, 10);
+    switch (**end) {
+    case 'k': case 'K': n <<= 10; ++*end; break;
+    case 'm': case 'M': n <<= 20; ++*end; break;
+    case 'g': case 'G': n <<= 30; ++*end; break;
+    }
+    return n;
+}
+
+static long file_size(char *path)
+{
+    FILE *fp;
+    long n;
+
+    if ((fp=fopen(path, "rb")) == NULL)
+        return -1;
+    fseek(fp, 0, SEEK_END);
+    n = ftell(fp);
+    fclose(fp);
+    return n;
+}
+
+static long count_tokens(char *grammar)
+{
+    char cmd[1024];
+    FILE *fp;
+    long n;
+
+    snprintf(cmd, sizeof(cmd), "%s %s %s -t", genrec, grammar, TMP_INPUT);
+    if ((fp=popen(cmd, "r")) == NULL)
+        return -1;
+    if (fscanf(fp, "%ld", &n) != 1)
+        n = -1;
+    pclose(fp);
+    return n;
+}
+
+static void bench(FILE *out, char *grammar, char *engine, char *argv[], long bytes, long tokens, int nruns)
+{
+    double secs[MAX_RUNS], med, min;
+    long max_rss;
+    int64_t instr;
+    int i;
+    Run r;
+
+    max_rss = 0;
+    instr = -1;
+    for (i = 0; i < nruns; i++) {
+        r = run(argv);
+        if (!WIFEXITED(r.status) || WEXITSTATUS(r.status)!=0) {
+            fprintf(stderr, "%s: %s: %s failed on %ld bytes\n", prog_name, grammar, engine, bytes);
+            return;
+        }
+        secs[i] = r.secs;
+        if (r.max_rss > max_rss)
+            max_rss = r.max_rss;
+        if (r.instr>=0 && (instr<0 || r.instr<instr))
+            instr = r.instr;
+    }
+    qsort(secs, nruns, sizeof(secs[0]), cmp_double);
+    min = secs[0];
+    med = (nruns%2)?secs[nruns/2]:(secs[nruns/2-1]+secs[nruns/2])/2;
+    fprintf(out, "%s,%s,%ld,%ld,%d,%.6f,%.6f,%.2f,%.3f,%ld,", grammar, engine, bytes, tokens, nruns,
+    med, min, bytes/med/1e6, tokens/med/1e6, max_rss);
+    if (instr >= 0)
+        fprintf(out, "%.1f", tokens?(double)instr/tokens:0.0);
+    fprintf(out, "\n");
+    fflush(out);
+}
+
+int main(int argc, char *argv[])
+{
+    long sizes[MAX_SIZES];
+    int nsizes, nruns, i, j;
+    char *outfile, *p, cmd[1024];
+    FILE *out;
+    glob_t gl;
+    char **grammars;
+    int ngrammars;
+
+    prog_name = argv[0];
+    nruns = 5;
+    outfile = NULL;
+    sizes[0] = 1<<20;
+    sizes[1] = 10<<20;
+    nsizes = 2;
+    if ((p=getenv("GENREC")) != NULL)
+        genrec = p;
+    if ((p=getenv("CC")) != NULL)
+        cc = p;
+    for (i = 1; i<argc && argv[i][0]=='-'; i++) {
+        switch (argv[i][1]) {
+        case 'n':
+            if (++i >= argc || (nruns=atoi(argv[i]))<1 || nruns>MAX_RUNS)
+                DIE("-n expects a number of runs between 1 and %d", MAX_RUNS);
+            break;
+        case 's':
+            if (++i >= argc)
+                DIE("missing argument for -s option");
+            for (nsizes = 0, p = argv[i]; *p!='\0' && nsizes<MAX_SIZES; ) {
+                if ((sizes[nsizes++]=parse_size(p, &p)) <= 0)
+                    DIE("invalid size in `%s'", argv[i]);
+                if (*p == ',')
+                    ++p;
+            }
+            break;
+        case 'o':
+            if (++i >= argc)
+                DIE("missing argument for -o option");
+            outfile = argv[i];
+            break;
+        default:
+            fprintf(stderr, "usage: %s [ -n runs ] [ -s size,size,... ] [ -o file.csv ] [ grammar ... ]\n", prog_name);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (i < argc) {
+        grammars = argv+i;
+        ngrammars = argc-i;
+    } else {
+        if (glob("examples/grammar*.ebnf", 0, NULL, &gl) != 0)
+            DIE("no grammars found in examples/");
+        grammars = gl.gl_pathv;
+        ngrammars = (int)gl.gl_pathc;
+    }
+    if (outfile == NULL)
+        out = stdout;
+    else if ((out=fopen(outfile, "w")) == NULL)
+        DIE("cannot write to `%s'", outfile);
+    fprintf(out, "grammar,engine,bytes,tokens,runs,median_s,min_s,mb_s,mtok_s,max_rss_kb,instr_tok\n");
+
+    for (i = 0; i < ngrammars; i++) {
+        char *g;
+        int have_rec;
+
+        g = grammars[i];
+        snprintf(cmd, sizeof(cmd), "%s %s -g -s -o %s.c && %s -O2 -o %s %s.c",
+        genrec, g, TMP_REC, cc, TMP_REC, TMP_REC);
+        have_rec = (system(cmd) == 0);
+        if (!have_rec)
+            fprintf(stderr, "%s: %s: cannot build the generated recognizer\n", prog_name, g);
+        for (j = 0; j < nsizes; j++) {
+            long bytes, tokens;
+            char *interp[] = { genrec, g, TMP_INPUT, NULL };
+            char *lexer[] = { genrec, g, TMP_INPUT, "-t", NULL };
+            char *rec[] = { TMP_REC, TMP_INPUT, NULL };
+
+            snprintf(cmd, sizeof(cmd), "%s %s -r%ld -S1 >%s", genrec, g, sizes[j], TMP_INPUT);
+            if (system(cmd) != 0) {
+                fprintf(stderr, "%s: %s: cannot generate input\n", prog_name, g);
+                continue;
+            }
+            /* grammars without repetitions only derive short strings */
+            if ((bytes=file_size(TMP_INPUT)) < sizes[j]/2) {
+                fprintf(stderr, "%s: %s: skipped (generated input has only %ld bytes)\n", prog_name, g, bytes);
+                break;
+            }
+            tokens = count_tokens(g);
+            bench(out, g, "interpreter", interp, bytes, tokens, nruns);
+            if (have_rec)
+                bench(out, g, "generated", rec, bytes, tokens, nruns);
+            bench(out, g, "lexer", lexer, bytes, tokens, nruns);
+        }
+    }
+    remove(TMP_INPUT);
+    remove(TMP_REC);
+    snprintf(cmd, sizeof(cmd), "%s.c", TMP_REC);
+    remove(cmd);
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}
@@ -0,0 +1,39 @@
+#!/bin/bash
+#
+# Time the interpreter on grammars where every rule captures its child
+# rule in a named buffer and splices it into its own output, for growing
+# nesting depths (up to 250 or so, there is one rule per level). The innermost
+# rule outputs a long list, so the output size barely depends on the depth
+# and neither should the time.
+#
+# usage: bench/nested.sh [genrec] [depths...]
+#
+
+genrec=${1:-./genrec}
+shift
+depths=${@:-"25 50 100 200"}
+tmp=${TMPDIR:-/tmp}/nested.$$
+trap "rm -f $tmp.ebnf $tmp.str" EXIT
+
+printf "%8s %12s %10s\n" depth "output bytes" seconds
+for d in $depths ; do
+    awk -v d=$d 'BEGIN {
+        pad = sprintf("%64s", "")
+        print "s* = { r0 } ;"
+        for (i = 0; i < d; i++)
+            printf "r%d = \"(\" r%d>$b \")\" {{ \"<%d%s>\" $b \"</%d>\" }} ;\n", i, i+1, i, pad, i
+        printf "r%d = { #NUM {{ * \" \" }} } {{ ; }} ;\n.\n", d
+    }' >$tmp.ebnf
+    awk -v d=$d 'BEGIN {
+        for (n = 0; n < 200; n++) {
+            for (i = 0; i < d; i++) printf "("
+            for (i = 0; i < 5000; i++) printf "%d ", i
+            for (i = 0; i < d; i++) printf ")"
+            print ""
+        }
+    }' >$tmp.str
+    start=$(date +%s%N)
+    bytes=$($genrec $tmp.ebnf $tmp.str | wc -c)
+    end=$(date +%s%N)
+    printf "%8d %12d %6d.%03d\n" $d $bytes $(((end-start)/1000000000)) $(((end-start)/1000000%1000))
+done
@@ -0,0 +1,38 @@
+#!/bin/bash
+#
+# Time $push/$pop with growing numbers of entries left on the save stack:
+# each of `depth' nested parentheses pushes and never pops, and inside them
+# every number is looked at with $push #NUM $pop before it is matched. The
+# number of pairs is the same at every depth, and so should be the time.
+#
+# usage: bench/pushpop.sh [genrec] [depths...]
+#
+
+genrec=${1:-./genrec}
+shift
+depths=${@:-"1 10 100 1000 5000"}
+tmp=${TMPDIR:-/tmp}/pushpop.$$
+trap "rm -f $tmp.ebnf $tmp.str" EXIT
+
+cat >$tmp.ebnf <<'GRAMMAR'
+s* = r ;
+r = "(" $push r ")" | b ;
+b = { $push #NUM $pop #NUM {{ * " " }} } {{ ; }} ;
+.
+GRAMMAR
+printf "%8s %10s %10s\n" depth pairs seconds
+for d in $depths ; do
+    awk -v d=$d 'BEGIN {
+        for (i = 0; i < d; i++) printf "("
+        for (i = 0; i < 1000000; i++) printf "%d%s", i, (i%16==15)?"\n":" "
+        for (i = 0; i < d; i++) printf ")"
+        print ""
+    }' >$tmp.str
+    start=$(date +%s%N)
+    if ! $genrec $tmp.ebnf $tmp.str >/dev/null ; then
+        printf "%8d %10s\n" $d failed
+        continue
+    fi
+    end=$(date +%s%N)
+    printf "%8d %10d %6d.%03d\n" $d 1000000 $(((end-start)/1000000000)) $(((end-start)/1000000%1000))
+done
@@ -25,20 +25,26 @@
 #include <assert.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include "util.h"
 #include "lex.h"
+#include "trace.h"
 
-#define HASH_SIZE       1009
-#define HASH(s)         (hash(s)%HASH_SIZE)
-#define MAX_RULES       256
 #define EMPTY_SET       ((uint64_t)0)
 #define SET_SIZE        63
 #define EMPTY           (1ULL << 63) /* ε */
 #define GRA_ERR         0
 #define GRA_SYN_ERR     1
 #define STR_ERR         2
-#define MAX_SAVE_STACK  16
-#define MAX_NAM_BUF     32
+#define FLUSH_SIZE      65536 /* output buffered by generated recognizers */
+#define OUT_FLUSH_SIZE  65536 /* output buffered by the interpreter */
 #define DIE(...)                            \
     do {                                    \
         fprintf(stderr, "%s: ", prog_name); \
@@ -48,10 +54,23 @@
     } while (0)
 
 typedef struct Node Node;
-typedef struct NodeChain NodeChain;
+typedef struct Symbol Symbol;
 typedef struct OutList OutList;
+typedef struct OutOp OutOp;
 typedef struct InState InState;
 typedef struct State State;
+typedef struct RuleProf RuleProf;
+typedef struct ProfFrame ProfFrame;
+typedef struct BtSite BtSite;
+typedef struct LaNode LaNode;
+typedef struct KSet KSet;
+typedef struct Stack Stack;
+typedef struct Config Config;
+typedef struct DfaState DfaState;
+typedef struct Decision Decision;
+typedef struct CallSite CallSite;
+typedef struct Chain Chain;
+typedef struct Hooks Hooks;
 
 typedef enum {
     TOK_DOT,
@@ -89,13 +108,18 @@ static char *prog_name;
 static char *grammar_file_path, *string_file_path;
 static char *grammar_buf, *curr_ch, token_string[MAX_TOKSTR_LEN];
 static Token grammar_curr_tok;
+static int grammar_eof;
 #define LA grammar_curr_tok
-static int line_number = 1;
 static int verbose;
 static int uses_gen;
-static int gen_usage[MAX_RULES];
+static int uses_ctrl;
+static int checkpoint_counter;
+static int spec_lexer;
+static int *gen_usage;
+static int *rule_nbufs; /* named buffers declared */
 static FILE *rec_file;
 static StrBuf *outbuf;
+static int flush_size = OUT_FLUSH_SIZE;
 
 enum {
     O_LAST,
@@ -110,9 +134,25 @@ enum {
 struct OutList {
     int kind;
     char *val;
+    int buf;    /* O_BUF: slot in the rule's frame */
     OutList *next;
 };
 
+/*
+    Output actions are compiled into arrays of OutOp. Adjacent literals
+    and new-lines are merged into a single O_VER, and consecutive "+"/"-"
+    into a single O_INC.
+*/
+#define OUT_INDENT  1   /* indent first if at the beginning of a line */
+#define OUT_NL      2   /* the text ends with a new-line */
+
+struct OutOp {
+    int kind;   /* O_VER, O_LAST, O_GEN, O_BUF or O_INC */
+    int flags;
+    char *str;  /* O_VER: text */
+    int len;    /* O_VER: length of the text, O_INC: change of indentation, O_BUF: slot */
+};
+
 enum {
     CTRL_PUSH,
     CTRL_POP,
@@ -137,70 +177,251 @@ static struct Node {
         } tok;
         struct {
             int num;
-            StrBuf *buf;
+            int buf;    /* slot of the caller's named buffer, -1 if none */
         } rule;
         struct {
             Token tok;
             Node *child[2];
+            int site;   /* TOK_ALTER_BT: index into bt_sites[] */
+            Decision *dec;  /* TOK_ALTER: -a prediction rooted here, NULL if none */
+            Chain *chain;   /* TOK_ALTER: -P/-U chain rooted here, NULL if none */
         } op;
-        OutList *out_list;
+        struct {
+            OutOp *ops;
+            int nops;
+        } out;
         int action;
     } attr;
     uint64_t first, follow;
-} *rules[MAX_RULES];
+    KSet *kfirst;   /* -k: FIRST_k once the rules' sets are known */
+    int kfirst_len; /* the k of kfirst */
+    Node *succ;     /* -a: what comes after n in its rule, NULL at the end */
+} **rules;
 
-static int rule_counter, nundef;
-static char *rule_names[MAX_RULES];
+static int rule_counter, rule_max, nundef;
+static char **rule_names;
+
+/* [[ | ]] sites, in grammar order */
+static struct BtSite {
+    int rule;
+    unsigned long tries, fails;
+    unsigned long fail_time; /* samples */
+    unsigned long rescanned; /* tokens matched by failed attempts */
+    unsigned long discarded; /* output bytes thrown away by rollbacks */
+    int max_depth;           /* of nested attempts */
+    LaNode *la;              /* -k: test that replaces the checkpoint, NULL if none */
+    int la_k;                /* tokens it looks at */
+    int la_follow;           /* it relies on FOLLOW_k: only good outside other [[ ]] */
+} *bt_sites;
+static int bt_site_counter, bt_site_max, rule_first_site;
 static int start_symbol = -1;
-static uint64_t follows[MAX_RULES];
+static int lookahead;   /* -k */
+static uint64_t *follows;
 static int follow_changed;
 static int have_follow;
 static uint64_t grammar_tokens;
 
+/*
+    A position in the input is the offset of the current token and of the
+    last matched one (-1 if none), which comes right before it. Going back
+    rescans those tokens.
+*/
 static struct State {
     struct InState {
         int token;
-        void *lex;
-        char last[MAX_TOKSTR_LEN];
+        long pos;
+        long last_pos;
     } input;
-    int outpos;
+    long outpos;
+    long evpos;     /* in the -E stream */
+    long evend;     /* end of the span of its last token */
+    Rope outrope;
     int outind;
     int verind;
     int atbeg;
     int gencnt;
     int outputting;
     int savetop;
+    int undotop, protect;
 } state;
 #define curr_tok (state.input.token)
-#define last_str (state.input.last)
+#define last_str (lex_last_string())
+
+/*
+    The $push/$pop stack. A checkpoint only records its height, so an
+    entry that is popped while a checkpoint taken with it on the stack is
+    alive (below `protect') goes to an undo log, from where rolling back
+    to that checkpoint puts it back.
+*/
+static InState *save_stack;
+static int save_stack_size;
+static struct Undo {
+    int slot;
+    InState input;
+} *undo_log;
+static int undo_log_size;
+
+static int saved_states; /* checkpoints alive */
+static long committed_pos = -1; /* main output the outermost checkpoint can take back; -1 if none */
+static long input_pin = -1;     /* input the outermost checkpoint can go back to; -1 if none */
+static long predict_pin = -1;   /* input -a scans ahead from; -1 if none */
+static int ev_fd = -1;          /* -E */
+static long ev_base, ev_len;    /* bytes of events written, and in ev_buf after them */
+static long ev_committed = -1;  /* events the outermost checkpoint can take back; -1 if none */
+
+static void ev_flush(long min);
+
+static long in_pin(InState *in)
+{
+    return (in->last_pos != -1)?in->last_pos:in->pos;
+}
+
+/*
+    The lowest input offset that may still be gone back to (the lexer's
+    pin hook). The last matched token counts, as a $push saves it.
+*/
+static long lowest_input(void)
+{
+    long pin, p;
+    int i;
+
+    pin = input_pin;
+    if (predict_pin!=-1 && (pin==-1 || predict_pin<pin))
+        pin = predict_pin;
+    if ((p=state.input.last_pos)!=-1 && (pin==-1 || p<pin))
+        pin = p;
+    if (state.savetop>0 && (pin==-1 || (p=in_pin(&save_stack[0]))<pin))
+        pin = p;
+    for (i = 0; i < state.undotop; i++)
+        if (pin==-1 || (p=in_pin(&undo_log[i].input))<pin)
+            pin = p;
+    return pin;
+}
+
+/* go back to a saved input position */
+static void set_input(InState *in)
+{
+    lex_reset(in->last_pos, in->pos);
+    state.input = *in;
+}
+
+static void push_input(void)
+{
+    if (state.savetop >= save_stack_size) {
+        save_stack_size = save_stack_size*2+16;
+        save_stack = realloc(save_stack, save_stack_size*sizeof(*save_stack));
+    }
+    state.input.pos = lex_token_pos();
+    save_stack[state.savetop++] = state.input;
+}
+
+static void pop_input(void)
+{
+    InState in;
 
-static InState save_stack[MAX_SAVE_STACK]; /* $push/$pop stack */
+    if (state.savetop <= 0)
+        DIE("$pop: stack underflow!");
+    in = save_stack[--state.savetop];
+    if (state.savetop < state.protect) {
+        if (state.undotop >= undo_log_size) {
+            undo_log_size = undo_log_size*2+16;
+            undo_log = realloc(undo_log, undo_log_size*sizeof(*undo_log));
+        }
+        undo_log[state.undotop].slot = state.savetop;
+        undo_log[state.undotop++].input = in;
+    }
+    set_input(&in);
+}
 
-static void save_state(State *st)
+/* the output sink is a named buffer or, if NULL, the main output */
+static void save_state(State *st, Rope *buf)
 {
-    state.outpos = strbuf_get_pos(outbuf);
-    state.input.lex = lex_get_state();
+    if (buf == NULL)
+        state.outpos = strbuf_get_pos(outbuf);
+    else
+        state.outrope = *buf;
+    state.input.pos = lex_token_pos();
+    state.evpos = ev_base+ev_len;
+    if (saved_states == 0) {
+        committed_pos = (buf == NULL)?state.outpos:-1;
+        input_pin = in_pin(&state.input);
+        ev_committed = state.evpos;
+    }
     *st = state;
+    if (state.savetop > state.protect)
+        state.protect = state.savetop;
+    ++saved_states;
 }
 
-static void restore_state(State *st)
+static void restore_state(State *st, Rope *buf)
 {
+    while (state.undotop > st->undotop) {
+        --state.undotop;
+        save_stack[undo_log[state.undotop].slot] = undo_log[state.undotop].input;
+    }
+    state.savetop = st->savetop;
+    set_input(&st->input);
     state = *st;
-    strbuf_set_pos(outbuf, state.outpos);
-    lex_set_state(state.input.lex);
+    if (buf == NULL)
+        strbuf_set_pos(outbuf, state.outpos);
+    else
+        *buf = state.outrope;
+    ev_len = state.evpos-ev_base;
 }
 
 static void dispose_state(State *st)
 {
-    free(st->input.lex);
+    state.protect = st->protect;
+    if (--saved_states == 0) {
+        committed_pos = input_pin = ev_committed = -1;
+        state.undotop = 0;
+    }
 }
 
-static struct NodeChain {
-    int num;
-    char *name;
-    Node *rule;
-    NodeChain *next;
-} *rule_table[HASH_SIZE];
+/*
+    Write the main output up to where the outermost checkpoint could still
+    rewind it, if at least min bytes are ready. Output of a backtracking
+    region is thus held back only while that region is undecided.
+*/
+static void flush_committed(int min)
+{
+    long pos, n;
+
+    pos = (committed_pos != -1)?committed_pos:strbuf_get_pos(outbuf);
+    n = pos-(strbuf_get_pos(outbuf)-strbuf_length(outbuf));
+    if (n>0 && n>=min)
+        strbuf_flush_to(outbuf, pos);
+}
+
+/*
+    Called by the lexer before it reads more input (which may block on a
+    pipe): hand over the output that no checkpoint can take back.
+*/
+static void flush_output(void)
+{
+    flush_committed(1);
+    fflush(stdout);
+    if (ev_fd != -1)
+        ev_flush(1);
+}
+
+/*
+    Names (of rules and of named buffers) are interned in a table with
+    open addressing that doubles when it gets half full, so each name is
+    stored once and the table stays fast however many rules there are.
+*/
+struct Symbol {
+    int rule;       /* number of the rule of that name, -1 if none */
+    int buf_rule;   /* rule_serial of the rule whose named buffer it is */
+    int buf_slot;   /* slot of that buffer */
+    char name[1];   /* the rest follows */
+};
+static struct SymSlot {
+    unsigned hash;
+    Symbol *sym;    /* NULL if free */
+} *sym_table;
+static unsigned sym_size, sym_count;
+static int rule_serial; /* rules parsed so far */
 
 static const char *strset(uint64_t s)
 {
@@ -226,7 +447,8 @@ static void err(int fatal, int level, char *fmt, ...)
 
     switch (level) {
     case GRA_SYN_ERR:
-        fprintf(stderr, "%s: %s:%d: error: ", prog_name, grammar_file_path, line_number);
+        fprintf(stderr, "%s: %s:%ld: error: ", prog_name, grammar_file_path,
+        count_newlines(grammar_buf, (long)(curr_ch-grammar_buf))+1);
         break;
     case STR_ERR:
         fprintf(stderr, "%s: %s:%d: error: ", prog_name, string_file_path, lex_lineno());
@@ -252,10 +474,9 @@ static Token get_token(void)
     Token tok;
     int state;
     int save, cindx;
-    int str_line;
-    static int eof_reached = FALSE;
+    char *str_begin;
 
-    if (eof_reached)
+    if (grammar_eof)
         return -1;
 
     cindx = 0;
@@ -269,8 +490,6 @@ static Token get_token(void)
         case START:
             if (c==' ' || c=='\t' || c=='\n') {
                 save = FALSE;
-                if (c == '\n')
-                    ++line_number;
             } if (isalpha(c) || c=='_') {
                 state = INID;
             } else if (isdigit(c)) {
@@ -278,7 +497,7 @@ static Token get_token(void)
             } else if (c == '"') {
                 save = FALSE;
                 state = INSTR;
-                str_line = line_number;
+                str_begin = curr_ch-1;
             } else if (c == '!') {
                 save = FALSE;
                 state = INCOMMENT;
@@ -288,7 +507,7 @@ static Token get_token(void)
                 case '\0':
                     tok = -1;
                     save = FALSE;
-                    eof_reached = TRUE;
+                    grammar_eof = TRUE;
                     break;
                 case '{':
                     if (*curr_ch == '{') {
@@ -383,10 +602,8 @@ static Token get_token(void)
                     c = '\"';
                     --cindx;
                 }
-            } else if (c == '\n') {
-                ++line_number;
             } else if (c == '\0') {
-                line_number = str_line;
+                curr_ch = str_begin;
                 err(1, GRA_SYN_ERR, "unterminated string");
             }
             break;
@@ -417,34 +634,69 @@ static void match(Token expected)
     LA = get_token();
 }
 
+static Symbol *intern(char *name)
+{
+    struct SymSlot *old;
+    Symbol *s;
+    unsigned h, i, n;
+
+    if (sym_count*2 >= sym_size) {
+        old = sym_table;
+        n = sym_size;
+        sym_size = (sym_size != 0)?sym_size*2:1024;
+        sym_table = calloc(sym_size, sizeof(*sym_table));
+        for (i = 0; i < n; i++) {
+            if (old[i].sym == NULL)
+                continue;
+            for (h = old[i].hash; sym_table[h&(sym_size-1)].sym != NULL; h++)
+                ;
+            sym_table[h&(sym_size-1)] = old[i];
+        }
+        free(old);
+    }
+    for (h = hash(name), i = h; (s=sym_table[i&(sym_size-1)].sym) != NULL; i++)
+        if (sym_table[i&(sym_size-1)].hash==h && strcmp(s->name, name)==0)
+            return s;
+    n = (unsigned)strlen(name);
+    s = malloc(sizeof(*s)+n);
+    s->rule = -1;
+    s->buf_rule = -1;
+    memcpy(s->name, name, n+1);
+    sym_table[i&(sym_size-1)].hash = h;
+    sym_table[i&(sym_size-1)].sym = s;
+    ++sym_count;
+    return s;
+}
+
 static int lookup_rule(char *name, Node *rule)
 {
-    unsigned h;
-    NodeChain *np;
+    Symbol *s;
 
-    h = HASH(name);
-    for (np = rule_table[h]; np != NULL; np = np->next)
-        if (strcmp(name, np->name) == 0)
-            break;
-    if (np == NULL) {
-        np = malloc(sizeof(NodeChain));
-        np->num = rule_counter;
-        np->name = strdup(name);
-        if ((np->rule=rule) == NULL)
+    s = intern(name);
+    if (s->rule == -1) {
+        if (rule_counter >= rule_max) {
+            rule_max = rule_max*2+64;
+            rules = realloc(rules, rule_max*sizeof(*rules));
+            rule_names = realloc(rule_names, rule_max*sizeof(*rule_names));
+            gen_usage = realloc(gen_usage, rule_max*sizeof(*gen_usage));
+            rule_nbufs = realloc(rule_nbufs, rule_max*sizeof(*rule_nbufs));
+        }
+        s->rule = rule_counter;
+        if (rule == NULL)
             ++nundef;
-        np->next = rule_table[h];
-        rule_table[h] = np;
-        rule_names[rule_counter] = np->name;
+        rule_names[rule_counter] = s->name;
+        gen_usage[rule_counter] = FALSE;
+        rule_nbufs[rule_counter] = 0;
         rules[rule_counter++] = rule;
-    } else if (np->rule == NULL) {
+    } else if (rules[s->rule] == NULL) {
         if (rule != NULL) {
-            rules[np->num] = np->rule = rule;
+            rules[s->rule] = rule;
             --nundef;
         }
     } else if (rule != NULL) {
         err(1, GRA_ERR, "rule `%s' redefined", name);
     }
-    return np->num;
+    return s->rule;
 }
 
 static Node *new_node(NodeKind kind)
@@ -456,24 +708,98 @@ static Node *new_node(NodeKind kind)
     return n;
 }
 
-static struct {
-    char *name;
-    StrBuf *buf;
-} named_buffers[MAX_NAM_BUF];
+/*
+    Named buffers have rule scope: the symbol of a name tells its slot if
+    the rule being parsed declared it. The buffers themselves are in a
+    frame that every invocation of the rule gets.
+*/
 static int nambuf_counter, rule_first_nambuf;
 
-static StrBuf *new_named_buffer(char *name)
+static int find_named_buffer(char *name)
 {
-    int i;
+    Symbol *s;
+
+    s = intern(name);
+    return (s->buf_rule == rule_serial)?s->buf_slot:-1;
+}
+
+static int new_named_buffer(char *name)
+{
+    Symbol *s;
+
+    s = intern(name);
+    if (s->buf_rule != rule_serial) {
+        s->buf_rule = rule_serial;
+        s->buf_slot = nambuf_counter++ - rule_first_nambuf;
+    }
+    return s->buf_slot;
+}
+
+static OutOp *new_out_op(Node *n, int kind, int flags)
+{
+    OutOp *op;
+
+    n->attr.out.ops = realloc(n->attr.out.ops, (n->attr.out.nops+1)*sizeof(OutOp));
+    op = &n->attr.out.ops[n->attr.out.nops++];
+    op->kind = kind;
+    op->flags = flags;
+    op->str = NULL;
+    op->len = 0;
+    return op;
+}
+
+/* turn the parsed list of output items into n's array of OutOp */
+static void compile_out_list(Node *n, OutList *t)
+{
+    OutList *next;
+    OutOp *op;
+    StrBuf *text;
 
-    if (nambuf_counter >= MAX_NAM_BUF)
-        err(1, GRA_ERR, "too many named buffers (max: %d)", MAX_NAM_BUF);
-    for (i = rule_first_nambuf; i < nambuf_counter; i++)
-        if (strcmp(named_buffers[i].name, name) == 0)
-            return named_buffers[i].buf;
-    named_buffers[i].name = strdup(name);
-    nambuf_counter++;
-    return (named_buffers[i].buf = strbuf_new(64));
+    op = NULL;
+    text = strbuf_new(64);
+    for (; t != NULL; t = next) {
+        next = t->next;
+        switch (t->kind) {
+        case O_VER:
+        case O_END:
+            if (op==NULL || op->kind!=O_VER || ((op->flags&OUT_NL) && t->kind==O_VER)) {
+                if (op!=NULL && op->kind==O_VER)
+                    op->str = strdup(strbuf_str(text));
+                strbuf_clear(text);
+                op = new_out_op(n, O_VER, (t->kind==O_VER)?OUT_INDENT:0);
+            }
+            if (t->kind == O_VER) {
+                strbuf_append(text, t->val, (int)strlen(t->val));
+                free(t->val);
+            } else {
+                strbuf_append(text, "\n", 1);
+                op->flags |= OUT_NL;
+            }
+            op->len = strbuf_length(text);
+            break;
+        case O_INC:
+        case O_DEC:
+            if (op==NULL || op->kind!=O_INC) {
+                if (op!=NULL && op->kind==O_VER)
+                    op->str = strdup(strbuf_str(text));
+                op = new_out_op(n, O_INC, 0);
+            }
+            op->len += (t->kind==O_INC)?4:-4;
+            break;
+        default: /* O_LAST, O_GEN, O_BUF */
+            if (op!=NULL && op->kind==O_VER)
+                op->str = strdup(strbuf_str(text));
+            op = new_out_op(n, t->kind, OUT_INDENT);
+            op->str = t->val;
+            if (t->kind == O_BUF)
+                op->len = t->buf;
+            break;
+        }
+        free(t);
+    }
+    if (op!=NULL && op->kind==O_VER)
+        op->str = strdup(strbuf_str(text));
+    strbuf_destroy(text);
 }
 
 static Node *expr(int bt);
@@ -500,6 +826,7 @@ static Node *factor(void)
     case TOK_ID:
         n = new_node(NonTermKind);
         n->attr.rule.num = lookup_rule(token_string, NULL);
+        n->attr.rule.buf = -1;
         match(TOK_ID);
         if (LA == TOK_RANGLE) {
             match(TOK_RANGLE);
@@ -584,14 +911,9 @@ static Node *factor(void)
                 t->kind = O_BUF;
                 match(TOK_DOLLAR);
                 if (LA == TOK_ID) {
-                    int i;
-
-                    for (i = rule_first_nambuf; i < nambuf_counter; i++)
-                        if (strcmp(named_buffers[i].name, token_string) == 0)
-                            break;
-                    if (i >= nambuf_counter)
+                    if ((t->buf=find_named_buffer(token_string)) == -1)
                         err(1, GRA_SYN_ERR, "undefined buffer `%s'", token_string);
-                    t->val = (char *)named_buffers[i].buf;
+                    t->val = NULL;
                 }
                 match(TOK_ID);
                 break;
@@ -603,7 +925,7 @@ static Node *factor(void)
         }
         match(TOK_RBRACE2);
         t->next = NULL;
-        n->attr.out_list = h.next;
+        compile_out_list(n, h.next);
     }
         break;
     case TOK_LBRACKET2:
@@ -628,6 +950,7 @@ static Node *factor(void)
                 err(1, GRA_SYN_ERR, "unknown action `%s'", token_string);
             n = new_node(CtrlKind);
             n->attr.action = action;
+            uses_ctrl = TRUE;
         }
         match(TOK_ID);
         break;
@@ -665,6 +988,14 @@ Node *expr(int bt)
     while (LA == TOK_ALTER) {
         q = new_node(OpKind);
         q->attr.op.tok = bt?TOK_ALTER_BT:TOK_ALTER;
+        if (bt) {
+            if (bt_site_counter >= bt_site_max) {
+                bt_site_max = bt_site_max*2+16;
+                bt_sites = realloc(bt_sites, bt_site_max*sizeof(*bt_sites));
+            }
+            memset(&bt_sites[bt_site_counter], 0, sizeof(*bt_sites));
+            q->attr.op.site = bt_site_counter++;
+        }
         match(TOK_ALTER);
         q->attr.op.child[0] = n;
         q->attr.op.child[1] = term();
@@ -689,7 +1020,9 @@ static void rule(void)
         is_start = TRUE;
     }
     match(TOK_EQ);
+    ++rule_serial;
     rule_first_nambuf = nambuf_counter;
+    rule_first_site = bt_site_counter;
     n = expr(FALSE);
     match(TOK_SEMI);
     if (is_start) {
@@ -699,9 +1032,12 @@ static void rule(void)
     } else {
         num = lookup_rule(id, n);
     }
+    for (; rule_first_site < bt_site_counter; rule_first_site++)
+        bt_sites[rule_first_site].rule = num;
 
     gen_usage[num] = uses_gen;
     uses_gen = FALSE;
+    rule_nbufs[num] = nambuf_counter-rule_first_nambuf;
 }
 
 /* grammar = rule { rule } "." */
@@ -796,6 +1132,7 @@ static void compute_follow_sets(void)
 
     if (have_follow)
         return;
+    follows = calloc(rule_counter, sizeof(*follows));
     follows[start_symbol] |= 1ULL<<lex_name2num("EOF");
     follow_changed = TRUE;
     while (follow_changed) {
@@ -835,8 +1172,17 @@ static void conflict(Node *n, int rule_num)
     }
 }
 
-static void check_for_left_rec(uint64_t rule_msk, Node *n)
+/*
+    Left-recursion is a cycle of rules that call each other before
+    matching anything: a depth-first search over those calls finds one
+    when it gets back to a rule it is still in.
+*/
+static char *left_rec_state;    /* per rule: 0 not seen, 1 in progress, 2 done */
+
+static void check_for_left_rec(Node *n)
 {
+    int num;
+
     switch (n->kind) {
     case OutKind:
     case CtrlKind:
@@ -844,25 +1190,30 @@ static void check_for_left_rec(uint64_t rule_msk, Node *n)
     case TermKind:
         break;
     case NonTermKind:
-        if (rule_msk & (1ULL<<n->attr.rule.num))
-            err(1, GRA_ERR, "rule `%s' contains left-recursion", rule_names[n->attr.rule.num]);
-        check_for_left_rec(rule_msk|(1ULL<<n->attr.rule.num), rules[n->attr.rule.num]);
+        num = n->attr.rule.num;
+        if (left_rec_state[num] == 1)
+            err(1, GRA_ERR, "rule `%s' contains left-recursion", rule_names[num]);
+        if (left_rec_state[num] == 0) {
+            left_rec_state[num] = 1;
+            check_for_left_rec(rules[num]);
+            left_rec_state[num] = 2;
+        }
         break;
     case OpKind:
         switch (n->attr.op.tok) {
         case TOK_ALTER:      /* | */
         case TOK_ALTER_BT:   /* [[ | ]] */
-            check_for_left_rec(rule_msk, n->attr.op.child[0]);
-            check_for_left_rec(rule_msk, n->attr.op.child[1]);
+            check_for_left_rec(n->attr.op.child[0]);
+            check_for_left_rec(n->attr.op.child[1]);
             break;
         case TOK_CONCAT:     /*   */
-            check_for_left_rec(rule_msk, n->attr.op.child[0]);
+            check_for_left_rec(n->attr.op.child[0]);
             if (first(n->attr.op.child[0]) & EMPTY)
-                check_for_left_rec(rule_msk, n->attr.op.child[1]);
+                check_for_left_rec(n->attr.op.child[1]);
             break;
         case TOK_REPET:      /* {} */
         case TOK_OPTION:     /* [] */
-            check_for_left_rec(rule_msk, n->attr.op.child[0]);
+            check_for_left_rec(n->attr.op.child[0]);
             break;
         }
         break;
@@ -874,170 +1225,2551 @@ static void conflicts(void)
 {
     int i;
 
-    check_for_left_rec(1ULL<<start_symbol, rules[start_symbol]);
+    left_rec_state = calloc(rule_counter, 1);
+    left_rec_state[start_symbol] = 1;
+    check_for_left_rec(rules[start_symbol]);
     compute_follow_sets();
     for (i = 0; i < rule_counter; i++)
         conflict(rules[i], i);
 }
 
-static int recognize(Node *n, int *gen, int bt, StrBuf *buf)
+/* ============================================================ */
+/* LL(k) lookahead for [[ ]]                                    */
+/* ============================================================ */
+
+/*
+    With -k<n>, a [[ A | B ]] site that n tokens of lookahead decide the
+    way backtracking would is given a test of those tokens instead of a
+    checkpoint. Whatever A matches starts the input, so A can only
+    succeed on inputs that begin with a string of FIRST_k(A) (one shorter
+    than k stands for every input it begins). Likewise for B, and if B is
+    followed by what can follow the site, B can only lead to a successful
+    parse on inputs that begin with a string of FIRST_k(B FOLLOW_k). If no
+    input is in both, choosing A on the former and B otherwise only
+    changes where an error is reported. The FOLLOW_k variant does not hold
+    under an enclosing checkpoint (B may succeed, and whatever follows
+    fail, within it), so there the site still backtracks.
+
+    $pop moves the input back, which breaks all of this: sites that can
+    reach one are left alone, and FOLLOW_k is not used if there is any.
+*/
+#define MAX_LOOKAHEAD   (LEX_MAX_PEEK+1)
+#define MAX_KSET        4096
+
+/* up to MAX_LOOKAHEAD tokens: the length in the low 3 bits, then 6 bits per token */
+typedef uint64_t KStr;
+#define KLEN(x)     ((int)((x)&7))
+#define KTOK(x, i)  ((int)(((x)>>(3+6*(i)))&63))
+#define KSTR1(tok)  (1|((KStr)(tok)<<3))
+
+struct KSet {
+    int n, max;
+    int all;    /* too large to track: may be anything */
+    KStr *s;    /* sorted */
+};
+
+struct LaNode {
+    uint64_t leaf;  /* tokens that decide for A at this depth */
+    uint64_t inner; /* tokens that need the next one */
+    LaNode *next[SET_SIZE];
+};
+
+static KSet *rule_firstk, *rule_followk, *site_followk;
+static int *rule_pops, grammar_pops;
+static int la_len;  /* the k the sets are computed for */
+static int rule_firstk_done;
+
+static KStr kstr_cat(KStr a, KStr b, int k)
 {
-    int res;
+    int i, n;
 
-    switch (n->kind) {
-    case OutKind: {
-        OutList *t;
+    for (i = 0, n = KLEN(a); i<KLEN(b) && n<k; i++, n++)
+        a |= (KStr)KTOK(b, i)<<(3+6*n);
+    return (a&~(KStr)7)|n;
+}
 
-        if (!state.outputting)
-            return TRUE;
-        for (t = n->attr.out_list; t != NULL; t = t->next) {
-            switch (t->kind) {
-            case O_LAST:
-                strbuf_printf(buf, "%*s%s", (state.atbeg && state.outind>0)?state.outind:0, "", last_str);
-                state.atbeg = FALSE;
-                break;
-            case O_GEN:
-                if (*gen == -1)
-                    *gen = state.gencnt++;
-                strbuf_printf(buf, "%*s%d", (state.atbeg && state.outind>0)?state.outind:0, "", *gen);
-                state.atbeg = FALSE;
-                break;
-            case O_INC:
-                state.outind += 4;
-                break;
-            case O_DEC:
-                state.outind -= 4;
-                break;
-            case O_END:
-                strbuf_printf(buf, "\n");
-                state.atbeg = TRUE;
-                break;
-            case O_BUF: {
-                char *s;
-                int len;
+static KStr kstr_trunc(KStr a, int k)
+{
+    if (KLEN(a) <= k)
+        return a;
+    return (a&(((KStr)1<<(3+6*k))-1)&~(KStr)7)|k;
+}
 
-                s = strbuf_str((StrBuf *)t->val);
-                len = strbuf_length((StrBuf *)t->val);
-                strbuf_printf(buf, "%*s%s", (state.atbeg && state.outind>0)?state.outind:0, "", s);
-                state.atbeg = (len>0 && s[len-1]=='\n');
-            }
-                break;
-            case O_VER:
-                strbuf_printf(buf, "%*s%s", (state.atbeg && state.outind>0)?state.outind:0, "", t->val);
-                state.atbeg = FALSE;
-                break;
-            }
+/* is one a prefix of the other? */
+static int kstr_overlap(KStr a, KStr b)
+{
+    if (KLEN(a) > KLEN(b))
+        a = kstr_trunc(a, KLEN(b));
+    else
+        b = kstr_trunc(b, KLEN(a));
+    return a == b;
+}
+
+static int kset_add(KSet *d, KStr x)
+{
+    int lo, hi, mid;
+
+    if (d->all)
+        return FALSE;
+    for (lo = 0, hi = d->n; lo < hi; ) {
+        mid = (lo+hi)/2;
+        if (d->s[mid] == x)
+            return FALSE;
+        if (d->s[mid] < x)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    if (d->n >= MAX_KSET) {
+        d->all = TRUE;
+        return TRUE;
+    }
+    if (d->n >= d->max) {
+        d->max = d->max*2+16;
+        d->s = realloc(d->s, d->max*sizeof(*d->s));
+    }
+    memmove(d->s+lo+1, d->s+lo, (d->n-lo)*sizeof(*d->s));
+    d->s[lo] = x;
+    ++d->n;
+    return TRUE;
+}
+
+/* returns whether d changed */
+static int kset_union(KSet *d, KSet *s)
+{
+    int i, changed;
+
+    if (d->all)
+        return FALSE;
+    if (s->all) {
+        d->all = TRUE;
+        return TRUE;
+    }
+    for (i = changed = 0; i < s->n; i++)
+        changed |= kset_add(d, s->s[i]);
+    return changed;
+}
+
+/* d gets FIRST_k(a b) */
+static void kset_cat(KSet *d, KSet *a, KSet *b)
+{
+    int i, j;
+
+    if (a->all) {
+        d->all = TRUE;
+        return;
+    }
+    for (i = 0; i<a->n && !d->all; i++) {
+        if (KLEN(a->s[i]) == la_len) {
+            kset_add(d, a->s[i]);
+        } else if (b->all) {
+            d->all = TRUE;
+            return;
+        } else {
+            for (j = 0; j<b->n && !d->all; j++)
+                kset_add(d, kstr_cat(a->s[i], b->s[j], la_len));
         }
-        if (!bt && buf==outbuf)
-            strbuf_flush(buf);
-        res = TRUE;
     }
-        break;
+}
+
+static void kset_free(KSet *d)
+{
+    free(d->s);
+    memset(d, 0, sizeof(*d));
+}
+
+static int kset_equal(KSet *a, KSet *b)
+{
+    return a->all==b->all && a->n==b->n && memcmp(a->s, b->s, a->n*sizeof(*a->s))==0;
+}
+
+static void firstk_of(Node *n, KSet *d);
+
+static void firstk(Node *n, KSet *d)
+{
+    if (!rule_firstk_done) {
+        firstk_of(n, d);
+        return;
+    }
+    if (n->kfirst_len != la_len) {
+        if (n->kfirst == NULL)
+            n->kfirst = calloc(1, sizeof(KSet));
+        kset_free(n->kfirst);
+        firstk_of(n, n->kfirst);
+        n->kfirst_len = la_len;
+    }
+    kset_union(d, n->kfirst);
+}
+
+static void firstk_of(Node *n, KSet *d)
+{
+    KSet a = { 0 }, b = { 0 }, c;
+
+    switch (n->kind) {
+    case OutKind:
     case CtrlKind:
-        switch (n->attr.action) {
-        case CTRL_PUSH:
-            if (state.savetop >= MAX_SAVE_STACK)
-                DIE("$push: stack overflow!");
-            state.input.lex = lex_get_state();
-            save_stack[state.savetop++] = state.input;
+        kset_add(d, 0);
+        break;
+    case TermKind:
+        kset_add(d, KSTR1(n->attr.tok.num));
+        break;
+    case NonTermKind:
+        kset_union(d, &rule_firstk[n->attr.rule.num]);
+        break;
+    case OpKind:
+        switch (n->attr.op.tok) {
+        case TOK_ALTER:      /* | */
+        case TOK_ALTER_BT:   /* [[ | ]] */
+            firstk(n->attr.op.child[0], d);
+            firstk(n->attr.op.child[1], d);
             break;
-        case CTRL_POP:
-            if (state.savetop <= 0)
-                DIE("$pop: stack underflow!");
-            state.input = save_stack[--state.savetop];
-            lex_set_state(state.input.lex);
-            free(state.input.lex);
+        case TOK_CONCAT:     /*   */
+            firstk(n->attr.op.child[0], &a);
+            firstk(n->attr.op.child[1], &b);
+            kset_cat(d, &a, &b);
             break;
-        case CTRL_EOUT:
-            state.outputting = TRUE;
+        case TOK_REPET:      /* {} */
+            firstk(n->attr.op.child[0], &a);
+            kset_add(&b, 0);
+            for (;;) {
+                memset(&c, 0, sizeof(c));
+                kset_add(&c, 0);
+                kset_cat(&c, &a, &b);
+                if (kset_equal(&c, &b)) {
+                    kset_free(&c);
+                    break;
+                }
+                kset_free(&b);
+                b = c;
+            }
+            kset_union(d, &b);
             break;
-        case CTRL_DOUT:
-            state.outputting = FALSE;
+        case TOK_OPTION:     /* [] */
+            firstk(n->attr.op.child[0], d);
+            kset_add(d, 0);
             break;
         }
-        res = TRUE;
-        break;
-    case TermKind:
-        if (curr_tok != n->attr.tok.num) {
-            if (!bt)
-                err(1, STR_ERR, "unexpected `%s'", lex_num2print(curr_tok));
-            res = FALSE;
-        } else {
-            if (verbose) {
-                int i;
-
-                for (i = state.verind; i; i--)
-                    printf("--");
-                printf("<< matched `%s' (%s:%d)\n", lex_num2print(curr_tok), string_file_path, lex_lineno());
-            }
-            strcpy(last_str, lex_token_string());
-            curr_tok = lex_get_token();
-            res = TRUE;
-        }
         break;
-    case NonTermKind: {
-        int _gen;
+    }
+    kset_free(&a);
+    kset_free(&b);
+}
 
-        if (verbose) {
-            int i;
+static void followk(Node *n, KSet *in)
+{
+    KSet a = { 0 }, b = { 0 };
 
-            for (i = state.verind; i; i--)
-                printf("--");
-            printf(">> replacing `%s' (%s:%d)\n", rule_names[n->attr.rule.num], string_file_path, lex_lineno());
-        }
-        ++state.verind;
-        _gen = -1;
-        if (n->attr.rule.buf != NULL) {
-            buf = n->attr.rule.buf;
-            strbuf_clear(buf);
-        }
-        res = recognize(rules[n->attr.rule.num], &_gen, bt, buf);
-        --state.verind;
-    }
+    switch (n->kind) {
+    case OutKind:
+    case CtrlKind:
+    case TermKind:
+        break;
+    case NonTermKind:
+        if (kset_union(&rule_followk[n->attr.rule.num], in))
+            follow_changed = TRUE;
         break;
     case OpKind:
         switch (n->attr.op.tok) {
+        case TOK_ALTER_BT:   /* [[ | ]] */
+            kset_free(&site_followk[n->attr.op.site]);
+            kset_union(&site_followk[n->attr.op.site], in);
+            /* fall through */
         case TOK_ALTER:      /* | */
-            if (first(n->attr.op.child[0]) & (1ULL<<curr_tok))
-                res = recognize(n->attr.op.child[0], gen, bt, buf);
-            else
-                res = recognize(n->attr.op.child[1], gen, bt, buf);
-            break;
-        case TOK_ALTER_BT: { /* [[ | ]] */
-            State st;
-
-            res = FALSE;
-            save_state(&st);
-            if ((first(n->attr.op.child[0]) & (1ULL<<curr_tok))
-            && !(res=recognize(n->attr.op.child[0], gen, TRUE, buf)))
-                restore_state(&st);
-            if (!res && !(res=recognize(n->attr.op.child[1], gen, bt, buf)))
-                restore_state(&st);
-            dispose_state(&st);
-        }
+            followk(n->attr.op.child[0], in);
+            followk(n->attr.op.child[1], in);
             break;
         case TOK_CONCAT:     /*   */
-            if (res = recognize(n->attr.op.child[0], gen, bt, buf))
-                res = recognize(n->attr.op.child[1], gen, bt, buf);
+            firstk(n->attr.op.child[1], &a);
+            kset_cat(&b, &a, in);
+            followk(n->attr.op.child[0], &b);
+            followk(n->attr.op.child[1], in);
             break;
         case TOK_REPET:      /* {} */
-            res = TRUE;
-            while (res && (first(n->attr.op.child[0]) & (1ULL<<curr_tok)))
-                res = recognize(n->attr.op.child[0], gen, bt, buf);
+            firstk(n, &a);
+            kset_cat(&b, &a, in);
+            followk(n->attr.op.child[0], &b);
             break;
         case TOK_OPTION:     /* [] */
-            res = TRUE;
-            if (first(n->attr.op.child[0]) & (1ULL<<curr_tok))
-                res = recognize(n->attr.op.child[0], gen, bt, buf);
+            followk(n->attr.op.child[0], in);
             break;
         }
         break;
     }
-    return res;
+    kset_free(&a);
+    kset_free(&b);
 }
 
-/* ============================================================ */
-/* Source code emitters                                         */
+static int pops(Node *n)
+{
+    switch (n->kind) {
+    case CtrlKind:
+        return n->attr.action == CTRL_POP;
+    case NonTermKind:
+        return rule_pops[n->attr.rule.num];
+    case OpKind:
+        return pops(n->attr.op.child[0]) || (n->attr.op.child[1]!=NULL && pops(n->attr.op.child[1]));
+    default:
+        return FALSE;
+    }
+}
+
+static void la_insert(LaNode *t, KStr x)
+{
+    int i, tok;
+
+    for (i = 0; i < KLEN(x); i++) {
+        tok = KTOK(x, i);
+        if (t->leaf & (1ULL<<tok))
+            return;
+        if (i == KLEN(x)-1) {
+            t->leaf |= 1ULL<<tok;
+            t->inner &= ~(1ULL<<tok);
+            return;
+        }
+        t->inner |= 1ULL<<tok;
+        if (t->next[tok] == NULL)
+            t->next[tok] = calloc(1, sizeof(LaNode));
+        t = t->next[tok];
+    }
+}
+
+/* the shortest prefix of x that no string of b overlaps */
+static KStr la_prefix(KStr x, KSet *b)
+{
+    KStr p;
+    int i, j;
+
+    for (j = 1; j < KLEN(x); j++) {
+        p = kstr_trunc(x, j);
+        for (i = 0; i < b->n; i++)
+            if (kstr_overlap(p, b->s[i]))
+                break;
+        if (i == b->n)
+            return p;
+    }
+    return x;
+}
+
+/* can no input begin with both a string of a and one of b? */
+static int kset_disjoint(KSet *a, KSet *b)
+{
+    int i, j;
+
+    if (a->all || b->all)
+        return FALSE;
+    for (i = 0; i < a->n; i++)
+        for (j = 0; j < b->n; j++)
+            if (kstr_overlap(a->s[i], b->s[j]))
+                return FALSE;
+    return TRUE;
+}
+
+static void decide_site(Node *n)
+{
+    KSet a = { 0 }, b = { 0 }, bf = { 0 };
+    BtSite *site;
+    uint64_t s;
+    int i, decided;
+
+    decided = FALSE;
+    site = &bt_sites[n->attr.op.site];
+    if (site->la!=NULL || pops(n->attr.op.child[0]) || pops(n->attr.op.child[1]))
+        return;
+    firstk(n->attr.op.child[0], &a);
+    if (!a.all && a.n>0 && a.s[0]==0) {
+        /* A matching nothing is only tried on its First tokens */
+        memmove(a.s, a.s+1, --a.n*sizeof(*a.s));
+        s = first(n->attr.op.child[0]);
+        for (i = 0; i < SET_SIZE; i++)
+            if (s & (1ULL<<i))
+                kset_add(&a, KSTR1(i));
+    }
+    firstk(n->attr.op.child[1], &b);
+    if (kset_disjoint(&a, &b)) {
+        decided = TRUE;
+    } else if (!grammar_pops) {
+        kset_cat(&bf, &b, &site_followk[n->attr.op.site]);
+        decided = site->la_follow = kset_disjoint(&a, &bf);
+    }
+    if (decided) {
+        site->la_k = la_len;
+        site->la = calloc(1, sizeof(LaNode));
+        for (i = 0; i < a.n; i++)
+            la_insert(site->la, la_prefix(a.s[i], site->la_follow?&bf:&b));
+    }
+    kset_free(&a);
+    kset_free(&b);
+    kset_free(&bf);
+}
+
+static void decide_sites_in(Node *n)
+{
+    if (n->kind != OpKind)
+        return;
+    if (n->attr.op.tok == TOK_ALTER_BT)
+        decide_site(n);
+    decide_sites_in(n->attr.op.child[0]);
+    if (n->attr.op.child[1] != NULL)
+        decide_sites_in(n->attr.op.child[1]);
+}
+
+/* compute the sets for k = la_len */
+static void compute_k_sets(void)
+{
+    KSet t;
+    KStr eof;
+    int i, changed;
+
+    for (i = 0; i < rule_counter; i++) {
+        kset_free(&rule_firstk[i]);
+        kset_free(&rule_followk[i]);
+    }
+    rule_firstk_done = FALSE;
+    do {
+        changed = FALSE;
+        for (i = 0; i < rule_counter; i++) {
+            memset(&t, 0, sizeof(t));
+            firstk(rules[i], &t);
+            if (!kset_equal(&t, &rule_firstk[i])) {
+                kset_free(&rule_firstk[i]);
+                rule_firstk[i] = t;
+                changed = TRUE;
+            } else {
+                kset_free(&t);
+            }
+        }
+    } while (changed);
+    rule_firstk_done = TRUE;
+    if (grammar_pops)
+        return;
+    /* the lexer keeps returning EOF at the end */
+    for (eof = 0, i = 0; i < la_len; i++)
+        eof = kstr_cat(eof, KSTR1(lex_name2num("EOF")), la_len);
+    kset_add(&rule_followk[start_symbol], eof);
+    do {
+        follow_changed = FALSE;
+        for (i = 0; i < rule_counter; i++)
+            followk(rules[i], &rule_followk[i]);
+    } while (follow_changed);
+}
+
+/* give each site the smallest k up to -k that decides it */
+static void decide_sites(void)
+{
+    int i, changed;
+
+    rule_firstk = calloc(rule_counter, sizeof(*rule_firstk));
+    rule_followk = calloc(rule_counter, sizeof(*rule_followk));
+    rule_pops = calloc(rule_counter, sizeof(*rule_pops));
+    do {
+        changed = FALSE;
+        for (i = 0; i < rule_counter; i++) {
+            if (!rule_pops[i] && pops(rules[i]))
+                changed = rule_pops[i] = grammar_pops = TRUE;
+        }
+    } while (changed);
+    site_followk = calloc(bt_site_counter+1, sizeof(*site_followk));
+    for (la_len = 1; la_len <= lookahead; la_len++) {
+        for (i = 0; i<bt_site_counter && bt_sites[i].la!=NULL; i++)
+            ;
+        if (i == bt_site_counter)
+            break;
+        compute_k_sets();
+        for (i = 0; i < rule_counter; i++)
+            decide_sites_in(rules[i]);
+    }
+    for (i = 0; i < rule_counter; i++) {
+        kset_free(&rule_firstk[i]);
+        kset_free(&rule_followk[i]);
+    }
+    for (i = 0; i < bt_site_counter; i++)
+        kset_free(&site_followk[i]);
+    free(site_followk);
+}
+
+/* -k with -c: which [[ ]] sites a lookahead test replaces */
+static void print_la_report(void)
+{
+    int i, n;
+
+    for (i = n = 0; i < bt_site_counter; i++)
+        n += bt_sites[i].la != NULL;
+    fprintf(stderr, "lookahead (k=%d): %d of %d [[ ]] sites decided without backtracking\n",
+    lookahead, n, bt_site_counter);
+    for (i = 0; i < bt_site_counter; i++) {
+        BtSite *b;
+        char name[64];
+
+        b = &bt_sites[i];
+        snprintf(name, sizeof(name), "%s#%d", rule_names[b->rule], i);
+        if (b->la == NULL)
+            fprintf(stderr, "%-24s backtracks\n", name);
+        else
+            fprintf(stderr, "%-24s %d token%s%s\n", name, b->la_k, (b->la_k > 1)?"s":"",
+            b->la_follow?" (outside other [[ ]])":"");
+    }
+}
+
+/* ============================================================ */
+/* Adaptive prediction for | with First/First conflicts          */
+/* ============================================================ */
+
+/*
+    With -a, a chain of | whose alternatives share First tokens is a
+    decision: instead of taking the leftmost alternative the current
+    token allows, every alternative is simulated on the tokens ahead
+    until only one of them can go on. A configuration is an alternative,
+    a position in the grammar (a TermKind node, or past the end of the
+    start rule) and the stack of rules to return to. At the end of the
+    rule the decision is in, the caller is not known, so every place
+    that calls the rule is followed.
+
+    The sets of configurations are the states of a DFA, one per
+    decision, built as inputs need them: predicting again from the same
+    tokens only follows its edges. A state is decided when all its
+    configurations agree on an alternative, when the alternatives can
+    no longer be told apart (then the leftmost wins), or when none is
+    left (it is an error anyway). With -a<file> the DFAs are kept in
+    <file> from one run to the next.
+
+    $pop moves the input back, which the simulation cannot follow: a
+    state that reaches one leaves the choice to First.
+*/
+#define ALT_UNDECIDED   -2
+#define ALT_DEFAULT     -1  /* choose by First */
+#define STACK_HASH      4093
+#define DFA_HASH        4093
+#define MAX_PREDICT_DEPTH 1000  /* rules deep; only left-recursion goes further */
+
+struct Stack {      /* hash-consed, so equal stacks are the same pointer */
+    Node *call;     /* NonTermKind node to return to */
+    int rule;       /* the rule that contains it */
+    int depth;
+    Stack *next, *chain;
+};
+
+struct Config {
+    int alt;
+    int rule;   /* -1: past the end of the start rule */
+    Node *pos;
+    Stack *stk;
+};
+
+struct DfaState {
+    Decision *dec;
+    int alt;
+    int nconf;
+    Config *conf;   /* sorted by alternative */
+    unsigned hash;
+    int mark;
+    DfaState *chain;
+    DfaState *next[SET_SIZE];
+};
+
+struct Decision {
+    int rule, num;
+    int nalts;
+    Node **alts;
+    DfaState *start;
+};
+
+struct CallSite {
+    Node *call;
+    int rule;
+    CallSite *next;
+};
+
+static int adaptive;    /* -a */
+static char *dfa_path;
+static unsigned grammar_hash;
+static Decision **decisions;
+static int decision_counter, decision_max;
+static CallSite **call_sites;
+static Stack *stack_table[STACK_HASH];
+static DfaState *dfa_table[DFA_HASH];
+static int pred_eof;
+
+/* the configurations being collected, and those already closed over */
+static Config *conf_set;
+static int conf_n, conf_max;
+static struct ConfSeen {
+    Config c;
+    unsigned stamp;
+} *conf_seen;
+static unsigned conf_seen_size, conf_seen_n, conf_stamp;
+static int conf_bail;
+
+static Stack *stack_push(Node *call, int rule, Stack *next)
+{
+    Stack *s;
+    unsigned h;
+
+    h = (unsigned)(((uintptr_t)call>>4)*31+(uintptr_t)next)%STACK_HASH;
+    for (s = stack_table[h]; s != NULL; s = s->chain)
+        if (s->call==call && s->next==next)
+            return s;
+    s = malloc(sizeof(*s));
+    s->call = call;
+    s->rule = rule;
+    s->depth = (next != NULL)?next->depth+1:1;
+    s->next = next;
+    s->chain = stack_table[h];
+    stack_table[h] = s;
+    return s;
+}
+
+static unsigned conf_hash(Config *c)
+{
+    uintptr_t h;
+
+    h = (uintptr_t)c->pos*31+(uintptr_t)c->stk;
+    h = h*31+(unsigned)c->alt*7+(unsigned)c->rule;
+    return (unsigned)(h^(h>>17));
+}
+
+static unsigned conf_slot(Config *c)
+{
+    unsigned i;
+
+    for (i = conf_hash(c)%conf_seen_size; conf_seen[i].stamp == conf_stamp; i = (i+1)%conf_seen_size)
+        if (memcmp(&conf_seen[i].c, c, sizeof(*c)) == 0)
+            break;
+    return i;
+}
+
+/* returns FALSE if c was already seen by the current closure */
+static int conf_visit(Config *c)
+{
+    unsigned i, old_size;
+    struct ConfSeen *old;
+
+    if (conf_seen_n*2 >= conf_seen_size) {
+        old = conf_seen;
+        old_size = conf_seen_size;
+        conf_seen_size = conf_seen_size*2+1024;
+        conf_seen = calloc(conf_seen_size, sizeof(*conf_seen));
+        for (i = 0; i < old_size; i++)
+            if (old[i].stamp == conf_stamp)
+                conf_seen[conf_slot(&old[i].c)] = old[i];
+        free(old);
+    }
+    i = conf_slot(c);
+    if (conf_seen[i].stamp == conf_stamp)
+        return FALSE;
+    conf_seen[i].c = *c;
+    conf_seen[i].stamp = conf_stamp;
+    ++conf_seen_n;
+    return TRUE;
+}
+
+static void conf_add(Config *c)
+{
+    if (conf_n >= conf_max) {
+        conf_max = conf_max*2+64;
+        conf_set = realloc(conf_set, conf_max*sizeof(*conf_set));
+    }
+    conf_set[conf_n++] = *c;
+}
+
+/* add the configurations at tokens (or at the end) reachable from c */
+static void closure(Config c)
+{
+    CallSite *cs;
+    Config d;
+
+    for (;;) {
+        if (conf_bail || !conf_visit(&c))
+            return;
+        if (c.pos == NULL) {
+            if (c.rule == -1) {
+                conf_add(&c);
+                return;
+            }
+            if (c.stk != NULL) {
+                c.pos = c.stk->call->succ;
+                c.rule = c.stk->rule;
+                c.stk = c.stk->next;
+                continue;
+            }
+            if (c.rule == start_symbol) {
+                d = c;
+                d.rule = -1;
+                closure(d);
+            }
+            for (cs = call_sites[c.rule]; cs != NULL; cs = cs->next) {
+                d = c;
+                d.pos = cs->call->succ;
+                d.rule = cs->rule;
+                closure(d);
+            }
+            return;
+        }
+        switch (c.pos->kind) {
+        case TermKind:
+            conf_add(&c);
+            return;
+        case OutKind:
+            c.pos = c.pos->succ;
+            break;
+        case CtrlKind:
+            if (c.pos->attr.action == CTRL_POP) {
+                conf_bail = TRUE;
+                return;
+            }
+            c.pos = c.pos->succ;
+            break;
+        case NonTermKind:
+            c.stk = stack_push(c.pos, c.rule, c.stk);
+            if (c.stk->depth > MAX_PREDICT_DEPTH) {
+                conf_bail = TRUE;
+                return;
+            }
+            c.rule = c.pos->attr.rule.num;
+            c.pos = rules[c.rule];
+            break;
+        case OpKind:
+            switch (c.pos->attr.op.tok) {
+            case TOK_ALTER:      /* | */
+            case TOK_ALTER_BT:   /* [[ | ]] */
+                d = c;
+                d.pos = c.pos->attr.op.child[0];
+                closure(d);
+                c.pos = c.pos->attr.op.child[1];
+                break;
+            case TOK_CONCAT:     /*   */
+                c.pos = c.pos->attr.op.child[0];
+                break;
+            case TOK_REPET:      /* {} */
+            case TOK_OPTION:     /* [] */
+                d = c;
+                d.pos = c.pos->attr.op.child[0];
+                closure(d);
+                c.pos = c.pos->succ;
+                break;
+            }
+            break;
+        }
+    }
+}
+
+static void conf_begin(void)
+{
+    conf_n = 0;
+    conf_seen_n = 0;
+    conf_bail = FALSE;
+    if (++conf_stamp == 0) {
+        memset(conf_seen, 0, conf_seen_size*sizeof(*conf_seen));
+        conf_stamp = 1;
+    }
+}
+
+static int cmp_conf(const void *a, const void *b)
+{
+    const Config *x, *y;
+
+    x = a;
+    y = b;
+    if (x->alt != y->alt)
+        return (x->alt > y->alt)-(x->alt < y->alt);
+    if (x->rule != y->rule)
+        return (x->rule > y->rule)-(x->rule < y->rule);
+    if (x->pos != y->pos)
+        return ((uintptr_t)x->pos > (uintptr_t)y->pos)-((uintptr_t)x->pos < (uintptr_t)y->pos);
+    return ((uintptr_t)x->stk > (uintptr_t)y->stk)-((uintptr_t)x->stk < (uintptr_t)y->stk);
+}
+
+/* do all the alternatives in s have the same configurations otherwise? */
+static int conf_ambiguous(DfaState *s)
+{
+    int i, n, k;
+
+    for (n = 1; n<s->nconf && s->conf[n].alt==s->conf[0].alt; n++)
+        ;
+    for (i = n; i < s->nconf; i += n) {
+        if (i+n > s->nconf || (i+n<s->nconf && s->conf[i+n].alt==s->conf[i].alt))
+            return FALSE;
+        for (k = 0; k < n; k++)
+            if (s->conf[i+k].alt!=s->conf[i].alt || s->conf[i+k].rule!=s->conf[k].rule
+            || s->conf[i+k].pos!=s->conf[k].pos || s->conf[i+k].stk!=s->conf[k].stk)
+                return FALSE;
+    }
+    return TRUE;
+}
+
+/* the state of d for the configurations collected, dead ones choosing dead_alt */
+static DfaState *dfa_state(Decision *d, int dead_alt)
+{
+    DfaState *s;
+    unsigned h;
+    int i;
+
+    if (conf_bail || conf_n == 0) {
+        s = calloc(1, sizeof(*s));
+        s->dec = d;
+        s->alt = conf_bail?ALT_DEFAULT:dead_alt;
+        return s;
+    }
+    qsort(conf_set, conf_n, sizeof(*conf_set), cmp_conf);
+    for (h = (unsigned)(uintptr_t)d, i = 0; i < conf_n; i++)
+        h = h*31+conf_hash(&conf_set[i]);
+    for (s = dfa_table[h%DFA_HASH]; s != NULL; s = s->chain)
+        if (s->dec==d && s->hash==h && s->nconf==conf_n
+        && memcmp(s->conf, conf_set, conf_n*sizeof(*conf_set))==0)
+            return s;
+    s = calloc(1, sizeof(*s));
+    s->dec = d;
+    s->hash = h;
+    s->nconf = conf_n;
+    s->conf = malloc(conf_n*sizeof(*conf_set));
+    memcpy(s->conf, conf_set, conf_n*sizeof(*conf_set));
+    if (s->conf[0].alt == s->conf[conf_n-1].alt || conf_ambiguous(s))
+        s->alt = s->conf[0].alt;
+    else
+        s->alt = ALT_UNDECIDED;
+    s->chain = dfa_table[h%DFA_HASH];
+    dfa_table[h%DFA_HASH] = s;
+    return s;
+}
+
+static DfaState *dfa_start(Decision *d)
+{
+    Config c;
+    int i;
+
+    if (d->start != NULL)
+        return d->start;
+    conf_begin();
+    for (i = 0; i < d->nalts; i++) {
+        c.alt = i;
+        c.rule = d->rule;
+        c.pos = d->alts[i];
+        c.stk = NULL;
+        closure(c);
+    }
+    return d->start = dfa_state(d, ALT_DEFAULT);
+}
+
+/* the state s goes to on tok */
+static DfaState *dfa_move(DfaState *s, int tok)
+{
+    Config *c, *end, e;
+
+    if (s->next[tok] != NULL)
+        return s->next[tok];
+    conf_begin();
+    for (c = s->conf, end = c+s->nconf; c < end; c++) {
+        if (c->pos == NULL) {
+            if (tok == pred_eof)
+                conf_add(c);
+        } else if (c->pos->attr.tok.num == tok) {
+            e = *c;
+            e.pos = c->pos->succ;
+            closure(e);
+        }
+    }
+    /* an error: report it in the alternative that went furthest */
+    return s->next[tok] = dfa_state(s->dec, (s == s->dec->start)?ALT_DEFAULT:s->conf[0].alt);
+}
+
+static void set_succ(Node *n, Node *succ, int rule)
+{
+    CallSite *cs;
+
+    n->succ = succ;
+    switch (n->kind) {
+    case NonTermKind:
+        cs = malloc(sizeof(*cs));
+        cs->call = n;
+        cs->rule = rule;
+        cs->next = call_sites[n->attr.rule.num];
+        call_sites[n->attr.rule.num] = cs;
+        break;
+    case OpKind:
+        switch (n->attr.op.tok) {
+        case TOK_ALTER:      /* | */
+        case TOK_ALTER_BT:   /* [[ | ]] */
+            set_succ(n->attr.op.child[0], succ, rule);
+            set_succ(n->attr.op.child[1], succ, rule);
+            break;
+        case TOK_CONCAT:     /*   */
+            set_succ(n->attr.op.child[0], n->attr.op.child[1], rule);
+            set_succ(n->attr.op.child[1], succ, rule);
+            break;
+        case TOK_REPET:      /* {} */
+            set_succ(n->attr.op.child[0], n, rule);
+            break;
+        case TOK_OPTION:     /* [] */
+            set_succ(n->attr.op.child[0], succ, rule);
+            break;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/* the alternatives of the chain of | at n, in order */
+static void flatten_alts(Node *n, Node ***alts, int *nalts)
+{
+    if (n->kind==OpKind && n->attr.op.tok==TOK_ALTER) {
+        flatten_alts(n->attr.op.child[0], alts, nalts);
+        flatten_alts(n->attr.op.child[1], alts, nalts);
+        return;
+    }
+    *alts = realloc(*alts, (*nalts+1)*sizeof(**alts));
+    (*alts)[(*nalts)++] = n;
+}
+
+static void find_decisions(Node *n, int rule)
+{
+    Decision *d;
+    uint64_t seen;
+    int i, conflicting;
+
+    if (n->kind != OpKind)
+        return;
+    if (n->attr.op.tok != TOK_ALTER) {
+        find_decisions(n->attr.op.child[0], rule);
+        if (n->attr.op.child[1] != NULL)
+            find_decisions(n->attr.op.child[1], rule);
+        return;
+    }
+    d = calloc(1, sizeof(*d));
+    d->rule = rule;
+    flatten_alts(n, &d->alts, &d->nalts);
+    conflicting = FALSE;
+    for (i = 0, seen = EMPTY_SET; i < d->nalts; i++) {
+        if (first(d->alts[i]) & seen & ~EMPTY)
+            conflicting = TRUE;
+        seen |= first(d->alts[i]);
+    }
+    for (i = 0; i < d->nalts; i++)
+        find_decisions(d->alts[i], rule);
+    if (!conflicting) {
+        free(d->alts);
+        free(d);
+        return;
+    }
+    if (decision_counter >= decision_max) {
+        decision_max = decision_max*2+16;
+        decisions = realloc(decisions, decision_max*sizeof(*decisions));
+    }
+    d->num = decision_counter;
+    decisions[decision_counter++] = d;
+    n->attr.op.dec = d;
+}
+
+/* replay the token paths of a -a<file> into the DFAs */
+static void load_dfa_cache(void)
+{
+    char *text, *line, *next, *tok;
+    unsigned h;
+    int n, num;
+    DfaState *s;
+
+    if ((text=read_file(dfa_path)) == NULL)
+        return;
+    if (sscanf(text, "genrec-dfa %u %d", &h, &n)!=2 || h!=grammar_hash || n!=decision_counter) {
+        err(0, GRA_ERR, "ignoring `%s' (made for another grammar)", dfa_path);
+        free(text);
+        return;
+    }
+    for (line = strchr(text, '\n'); line != NULL; line = next) {
+        *line++ = '\0';
+        if ((next=strchr(line, '\n')) != NULL)
+            *next = '\0';
+        if ((tok=strtok(line, " ")) == NULL || (n=atoi(tok))<0 || n>=decision_counter)
+            continue;
+        for (s = dfa_start(decisions[n]); s->alt==ALT_UNDECIDED && (tok=strtok(NULL, " "))!=NULL; ) {
+            /* a token name, or the spelling of a keyword */
+            if ((num=lex_name2num(tok))<0 && (num=lex_str2num(tok))<0)
+                break;
+            if (num >= SET_SIZE)
+                break;
+            s = dfa_move(s, num);
+        }
+        if (next != NULL)
+            *next = '\n';
+    }
+    free(text);
+}
+
+static int *dfa_path_toks;
+static int dfa_path_max;
+
+/* a line for each edge, depth-first: replaying them builds the same states */
+static void save_dfa_state(FILE *fp, DfaState *s, int depth)
+{
+    DfaState *t;
+    int i, tok;
+
+    s->mark = TRUE;
+    if (depth >= dfa_path_max) {
+        dfa_path_max = dfa_path_max*2+16;
+        dfa_path_toks = realloc(dfa_path_toks, dfa_path_max*sizeof(*dfa_path_toks));
+    }
+    for (tok = 0; tok < SET_SIZE; tok++) {
+        if ((t=s->next[tok]) == NULL)
+            continue;
+        dfa_path_toks[depth] = tok;
+        if (t->alt!=ALT_UNDECIDED || t->mark) {
+            fprintf(fp, "%d", s->dec->num);
+            for (i = 0; i <= depth; i++)
+                fprintf(fp, " %s", lex_num2name(dfa_path_toks[i]));
+            fprintf(fp, "\n");
+        } else {
+            save_dfa_state(fp, t, depth+1);
+        }
+    }
+}
+
+static void save_dfa_cache(void)
+{
+    FILE *fp;
+    int i;
+
+    if ((fp=fopen(dfa_path, "w")) == NULL) {
+        fprintf(stderr, "%s: cannot write to `%s'\n", prog_name, dfa_path);
+        return;
+    }
+    fprintf(fp, "genrec-dfa %u %d\n", grammar_hash, decision_counter);
+    for (i = 0; i < decision_counter; i++)
+        if (decisions[i]->start != NULL)
+            save_dfa_state(fp, decisions[i]->start, 0);
+    fclose(fp);
+}
+
+static void init_adaptive(void)
+{
+    int i;
+
+    call_sites = calloc(rule_counter, sizeof(*call_sites));
+    for (i = 0; i < rule_counter; i++)
+        set_succ(rules[i], NULL, i);
+    for (i = 0; i < rule_counter; i++)
+        find_decisions(rules[i], i);
+    pred_eof = lex_name2num("EOF");
+    if (dfa_path != NULL) {
+        load_dfa_cache();
+        atexit(save_dfa_cache);
+    }
+}
+
+/* -a with -c: which | chains are predicted */
+static void print_adaptive_report(void)
+{
+    int i;
+
+    fprintf(stderr, "adaptive prediction: %d | chain%s with First/First conflicts\n",
+    decision_counter, (decision_counter != 1)?"s":"");
+    for (i = 0; i < decision_counter; i++) {
+        char name[64];
+
+        snprintf(name, sizeof(name), "%s#%d", rule_names[decisions[i]->rule], i);
+        fprintf(stderr, "%-24s %d alternatives\n", name, decisions[i]->nalts);
+    }
+}
+
+/* ============================================================ */
+/* Profile-guided ordering of |                                 */
+/* ============================================================ */
+
+/*
+    A chain of | whose alternatives all begin with tokens of their own
+    (no two share one, none can match nothing) takes the same one
+    whatever order they are tested in, except on a token none of them
+    begins with, which is an error anyway. With -P<file>, the interpreter
+    counts how often each such chain takes each alternative and adds the
+    counts to <file>. With -U<file>, the interpreter and the recognizers
+    generated with -g test the alternatives most taken first.
+*/
+struct Chain {
+    int rule;
+    int nalts;
+    Node **alts;            /* in grammar order */
+    int *order;             /* the order they are tested in */
+    unsigned long *counts;  /* -P: times each was taken */
+};
+
+static char *branch_prof_path, *branch_use_path;
+static Chain **chains;
+static int chain_counter, chain_max;
+
+static void find_chains(Node *n, int rule)
+{
+    Chain *c;
+    uint64_t seen, s;
+    int i, ordered;
+
+    if (n->kind != OpKind)
+        return;
+    if (n->attr.op.tok != TOK_ALTER) {
+        find_chains(n->attr.op.child[0], rule);
+        if (n->attr.op.child[1] != NULL)
+            find_chains(n->attr.op.child[1], rule);
+        return;
+    }
+    c = calloc(1, sizeof(*c));
+    c->rule = rule;
+    flatten_alts(n, &c->alts, &c->nalts);
+    ordered = TRUE;
+    for (i = 0, seen = EMPTY_SET; i < c->nalts; i++) {
+        s = first(c->alts[i]);
+        if ((s&EMPTY) || (s&seen))
+            ordered = FALSE;
+        seen |= s;
+    }
+    for (i = 0; i < c->nalts; i++)
+        find_chains(c->alts[i], rule);
+    if (!ordered) {
+        free(c->alts);
+        free(c);
+        return;
+    }
+    c->order = malloc(c->nalts*sizeof(*c->order));
+    c->counts = calloc(c->nalts, sizeof(*c->counts));
+    for (i = 0; i < c->nalts; i++)
+        c->order[i] = i;
+    if (chain_counter >= chain_max) {
+        chain_max = chain_max*2+16;
+        chains = realloc(chains, chain_max*sizeof(*chains));
+    }
+    chains[chain_counter++] = c;
+    n->attr.op.chain = c;
+}
+
+/*
+    The file has a line for each chain: its number, its rule and the
+    counts of its alternatives in grammar order. With use, they order
+    the tests; otherwise they are added to the counts of this run.
+*/
+static void read_branch_profile(char *path, int use)
+{
+    char *text, *line, *next, *tok;
+    unsigned h;
+    int n, i, j, k;
+    unsigned long *w;
+    Chain *c;
+
+    if ((text=read_file(path)) == NULL) {
+        if (use)
+            DIE("cannot read file `%s'", path);
+        return;
+    }
+    if (sscanf(text, "genrec-branches %u %d", &h, &n)!=2 || h!=grammar_hash || n!=chain_counter) {
+        err(0, GRA_ERR, "ignoring `%s' (made for another grammar)", path);
+        free(text);
+        return;
+    }
+    for (line = strchr(text, '\n'); line != NULL; line = next) {
+        *line++ = '\0';
+        if ((next=strchr(line, '\n')) != NULL)
+            *next = '\0';
+        if ((tok=strtok(line, " ")) == NULL || (n=atoi(tok))<0 || n>=chain_counter || strtok(NULL, " ")==NULL)
+            continue;
+        c = chains[n];
+        w = calloc(c->nalts, sizeof(*w));
+        for (i = 0; i<c->nalts && (tok=strtok(NULL, " "))!=NULL; i++)
+            w[i] = strtoul(tok, NULL, 10);
+        if (use) {
+            /* most taken first, ties in grammar order */
+            for (i = 1; i < c->nalts; i++) {
+                k = c->order[i];
+                for (j = i; j>0 && w[c->order[j-1]]<w[k]; j--)
+                    c->order[j] = c->order[j-1];
+                c->order[j] = k;
+            }
+        } else {
+            for (i = 0; i < c->nalts; i++)
+                c->counts[i] += w[i];
+        }
+        free(w);
+        if (next != NULL)
+            *next = '\n';
+    }
+    free(text);
+}
+
+static void write_branch_profile(void)
+{
+    FILE *fp;
+    int i, j;
+
+    if ((fp=fopen(branch_prof_path, "w")) == NULL) {
+        fprintf(stderr, "%s: cannot write to `%s'\n", prog_name, branch_prof_path);
+        return;
+    }
+    fprintf(fp, "genrec-branches %u %d\n", grammar_hash, chain_counter);
+    for (i = 0; i < chain_counter; i++) {
+        fprintf(fp, "%d %s", i, rule_names[chains[i]->rule]);
+        for (j = 0; j < chains[i]->nalts; j++)
+            fprintf(fp, " %lu", chains[i]->counts[j]);
+        fprintf(fp, "\n");
+    }
+    fclose(fp);
+}
+
+static void init_chains(void)
+{
+    int i;
+
+    for (i = 0; i < rule_counter; i++)
+        find_chains(rules[i], i);
+    if (branch_use_path != NULL)
+        read_branch_profile(branch_use_path, TRUE);
+    if (branch_prof_path != NULL) {
+        read_branch_profile(branch_prof_path, FALSE);
+        atexit(write_branch_profile);
+    }
+}
+
+static void out_append(Rope *buf, const char *s, int n)
+{
+    if (buf == NULL)
+        strbuf_append(outbuf, s, n);
+    else
+        rope_append(buf, s, n);
+}
+
+static void out_spaces(Rope *buf, int n)
+{
+    static char spaces[64];
+    int k;
+
+    if (buf == NULL) {
+        strbuf_fill(outbuf, ' ', n);
+        return;
+    }
+    if (spaces[0] == '\0')
+        memset(spaces, ' ', sizeof(spaces));
+    for (; n > 0; n -= k) {
+        k = (n > (int)sizeof(spaces))?(int)sizeof(spaces):n;
+        rope_append(buf, spaces, k);
+    }
+}
+
+/*
+    Frames of named buffers. Each invocation of a rule that declares
+    buffers gets its own, so recursive invocations do not share them. They
+    are carved out of a LIFO arena of blocks (a frame never moves, as the
+    caller's output may be going to one of its buffers) and released by
+    going back to the mark taken before.
+*/
+#define FRAME_BLOCK 1024
+
+typedef struct FrameBlock FrameBlock;
+static struct FrameBlock {
+    FrameBlock *prev, *next;
+    int siz, top;
+    Rope *r;
+} frame0, *frame_blk = &frame0; /* the block with the newest frame */
+typedef struct {
+    FrameBlock *blk;
+    int top;
+} FrameMark;
+static Rope *frame;  /* buffers of the rule being recognized */
+
+static Rope *frame_push(int n, FrameMark *m)
+{
+    FrameBlock *b;
+    int i;
+
+    m->blk = frame_blk;
+    m->top = frame_blk->top;
+    if (frame_blk->top+n > frame_blk->siz) {
+        if ((b=frame_blk->next)==NULL || b->siz<n) {
+            b = calloc(1, sizeof(*b));
+            b->siz = (n>FRAME_BLOCK)?n:FRAME_BLOCK;
+            b->r = malloc(b->siz*sizeof(*b->r));
+            b->prev = frame_blk;
+            if ((b->next=frame_blk->next) != NULL)
+                b->next->prev = b;
+            frame_blk->next = b;
+        }
+        b->top = 0;
+        frame_blk = b;
+    }
+    frame = &frame_blk->r[frame_blk->top];
+    frame_blk->top += n;
+    for (i = 0; i < n; i++)
+        rope_init(&frame[i]);
+    return frame;
+}
+
+static void frame_pop(FrameMark *m)
+{
+    frame_blk = m->blk;
+    frame_blk->top = m->top;
+}
+
+/*
+    Move the named buffers to a fresh arena when most of the old one
+    holds text that can no longer be reached (discarded speculative output
+    and buffers that were cleared).
+*/
+static void collect_ropes(void)
+{
+    static int limit = 1<<20;
+    Rope **v;
+    FrameBlock *b;
+    int i, n, live;
+
+    if (rope_arena_size() < limit)
+        return;
+    for (n = 0, b = &frame0; b != frame_blk->next; b = b->next)
+        n += b->top;
+    v = malloc((n+1)*sizeof(*v));
+    for (n = live = 0, b = &frame0; b != frame_blk->next; b = b->next) {
+        for (i = 0; i < b->top; i++) {
+            v[n] = &b->r[i];
+            live += v[n++]->len;
+        }
+    }
+    rope_collect(v, n);
+    free(v);
+    if (limit < live*2)
+        limit = live*2;
+}
+
+/*
+    Profiling (-p). Calls and tokens are counted exactly, time is sampled:
+    a SIGPROF timer sets prof_ticks, and the next rule entry or exit
+    charges the pending ticks to the rules on the stack (exclusive time to
+    the innermost one, inclusive time once to every rule present).
+*/
+#define PROF_INTERVAL   200 /* µs */
+static int profiling;
+static char *profile_path;
+static unsigned long tokens_matched;
+static volatile sig_atomic_t prof_ticks;
+static unsigned long prof_samples;
+static struct RuleProf {
+    unsigned long calls, tokens;
+    unsigned long incl, excl; /* samples */
+    int active;
+    unsigned long mark;
+} *rule_prof;
+static struct ProfFrame {
+    int rule;
+    unsigned long tokens;
+} *prof_stack;
+static int prof_top, prof_max;
+static uint64_t prof_start_ns;
+
+static uint64_t clock_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000+(uint64_t)ts.tv_nsec;
+}
+
+static void prof_tick(int sig)
+{
+    ++prof_ticks;
+}
+
+static void prof_sample(void)
+{
+    int i, ticks;
+
+    ticks = prof_ticks;
+    prof_ticks = 0;
+    prof_samples += ticks;
+    if (prof_top == 0)
+        return;
+    rule_prof[prof_stack[prof_top-1].rule].excl += ticks;
+    for (i = 0; i < prof_top; i++) {
+        RuleProf *r;
+
+        r = &rule_prof[prof_stack[i].rule];
+        if (r->mark != prof_samples) {
+            r->mark = prof_samples;
+            r->incl += ticks;
+        }
+    }
+}
+
+static void prof_enter(int rule)
+{
+    ProfFrame *f;
+
+    if (prof_ticks)
+        prof_sample();
+    if (prof_top >= prof_max) {
+        prof_max = prof_max*2+64;
+        prof_stack = realloc(prof_stack, prof_max*sizeof(*prof_stack));
+    }
+    f = &prof_stack[prof_top++];
+    f->rule = rule;
+    f->tokens = tokens_matched;
+    rule_prof[rule].calls++;
+    rule_prof[rule].active++;
+}
+
+static void prof_exit(void)
+{
+    ProfFrame *f;
+    RuleProf *r;
+
+    if (prof_ticks)
+        prof_sample();
+    f = &prof_stack[--prof_top];
+    r = &rule_prof[f->rule];
+    if (--r->active == 0)
+        r->tokens += tokens_matched-f->tokens;
+}
+
+static void prof_start(void)
+{
+    struct sigaction sa;
+    struct itimerval it;
+
+    rule_prof = calloc(rule_counter, sizeof(*rule_prof));
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = prof_tick;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGPROF, &sa, NULL);
+    it.it_interval.tv_sec = it.it_value.tv_sec = 0;
+    it.it_interval.tv_usec = it.it_value.tv_usec = PROF_INTERVAL;
+    setitimer(ITIMER_PROF, &it, NULL);
+    prof_start_ns = clock_ns();
+}
+
+static int cmp_rule_prof(const void *a, const void *b)
+{
+    unsigned long x, y;
+
+    x = rule_prof[*(int *)a].excl;
+    y = rule_prof[*(int *)b].excl;
+    return (x < y)-(x > y);
+}
+
+static int cmp_bt_site(const void *a, const void *b)
+{
+    unsigned long x, y;
+
+    x = bt_sites[*(int *)a].fail_time;
+    y = bt_sites[*(int *)b].fail_time;
+    return (x < y)-(x > y);
+}
+
+/* print the report to stderr and, with -p<file>, write it as JSON */
+static void write_profile(void)
+{
+    int i, *ord;
+    double scale, total;
+    FILE *fp;
+
+    total = (double)(clock_ns()-prof_start_ns);
+    scale = (prof_samples > 0)?total/(double)prof_samples:0; /* ns per sample */
+    ord = malloc((rule_counter+bt_site_counter)*sizeof(*ord));
+    for (i = 0; i < rule_counter; i++)
+        ord[i] = i;
+    qsort(ord, rule_counter, sizeof(*ord), cmp_rule_prof);
+    fprintf(stderr, "\nprofile: %lu tokens in %.3f ms\n", tokens_matched, total/1e6);
+    fprintf(stderr, "%-24s %10s %10s %10s %10s %6s\n", "rule", "calls", "tokens", "incl ms", "excl ms", "excl%");
+    for (i = 0; i < rule_counter; i++) {
+        RuleProf *r;
+
+        r = &rule_prof[ord[i]];
+        if (r->calls == 0)
+            break;
+        fprintf(stderr, "%-24s %10lu %10lu %10.3f %10.3f %6.1f\n", rule_names[ord[i]], r->calls, r->tokens,
+        (double)r->incl*scale/1e6, (double)r->excl*scale/1e6, (double)r->excl*scale*100/total);
+    }
+    if (bt_site_counter > 0) {
+        for (i = 0; i < bt_site_counter; i++)
+            ord[i] = i;
+        qsort(ord, bt_site_counter, sizeof(*ord), cmp_bt_site);
+        fprintf(stderr, "\n%-24s %10s %10s %10s %10s\n", "[[ ]] site", "tries", "succeeded", "failed", "failed ms");
+        for (i = 0; i < bt_site_counter; i++) {
+            BtSite *b;
+            char name[64];
+
+            b = &bt_sites[ord[i]];
+            snprintf(name, sizeof(name), "%s#%d", rule_names[b->rule], ord[i]);
+            fprintf(stderr, "%-24s %10lu %10lu %10lu %10.3f\n", name, b->tries, b->tries-b->fails,
+            b->fails, (double)b->fail_time*scale/1e6);
+        }
+    }
+    free(ord);
+
+    if (profile_path == NULL)
+        return;
+    if ((fp=fopen(profile_path, "w")) == NULL) {
+        fprintf(stderr, "%s: cannot write profile to `%s'\n", prog_name, profile_path);
+        return;
+    }
+    fprintf(fp, "{\n  \"tokens\": %lu,\n  \"time_ns\": %.0f,\n  \"rules\": [", tokens_matched, total);
+    for (i = 0; i < rule_counter; i++) {
+        RuleProf *r;
+
+        r = &rule_prof[i];
+        fprintf(fp, "%s\n    { \"name\": \"%s\", \"calls\": %lu, \"tokens\": %lu, "
+        "\"incl_ns\": %.0f, \"excl_ns\": %.0f }", i?",":"", rule_names[i], r->calls, r->tokens,
+        (double)r->incl*scale, (double)r->excl*scale);
+    }
+    fprintf(fp, "\n  ],\n  \"sites\": [");
+    for (i = 0; i < bt_site_counter; i++) {
+        BtSite *b;
+
+        b = &bt_sites[i];
+        fprintf(fp, "%s\n    { \"id\": %d, \"rule\": \"%s\", \"tries\": %lu, \"succeeded\": %lu, "
+        "\"failed\": %lu, \"failed_ns\": %.0f, \"rescanned\": %lu, \"discarded\": %lu, \"max_depth\": %d }",
+        i?",":"", i, rule_names[b->rule], b->tries, b->tries-b->fails, b->fails, (double)b->fail_time*scale,
+        b->rescanned, b->discarded, b->max_depth);
+    }
+    fprintf(fp, "\n  ]\n}\n");
+    fclose(fp);
+}
+
+/*
+    Backtracking report (-b): what the [[ ]] sites cost, sorted by the
+    tokens that had to be matched again after a rollback.
+*/
+static int bt_stats, bt_report, bt_nesting;
+
+static int cmp_bt_cost(const void *a, const void *b)
+{
+    BtSite *x, *y;
+
+    x = &bt_sites[*(int *)a];
+    y = &bt_sites[*(int *)b];
+    if (x->rescanned != y->rescanned)
+        return (x->rescanned < y->rescanned)-(x->rescanned > y->rescanned);
+    return (x->fails < y->fails)-(x->fails > y->fails);
+}
+
+static void write_bt_report(void)
+{
+    int i, *ord, depth;
+    unsigned long tries, fails, rescanned, discarded;
+
+    tries = fails = rescanned = discarded = 0;
+    depth = 0;
+    ord = malloc((bt_site_counter+1)*sizeof(*ord));
+    for (i = 0; i < bt_site_counter; i++) {
+        ord[i] = i;
+        tries += bt_sites[i].tries;
+        fails += bt_sites[i].fails;
+        rescanned += bt_sites[i].rescanned;
+        discarded += bt_sites[i].discarded;
+        if (bt_sites[i].max_depth > depth)
+            depth = bt_sites[i].max_depth;
+    }
+    qsort(ord, bt_site_counter, sizeof(*ord), cmp_bt_cost);
+    fprintf(stderr, "\nbacktracking: %lu attempts, %lu rollbacks, %lu tokens rescanned (of %lu matched), "
+    "%lu output bytes discarded, max nesting %d\n", tries, fails, rescanned, tokens_matched, discarded, depth);
+    if (bt_site_counter == 0)
+        return;
+    fprintf(stderr, "%-24s %10s %10s %10s %10s %6s\n", "[[ ]] site", "attempts", "rollbacks", "rescanned",
+    "discarded", "depth");
+    for (i = 0; i < bt_site_counter; i++) {
+        BtSite *b;
+        char name[64];
+
+        b = &bt_sites[ord[i]];
+        snprintf(name, sizeof(name), "%s#%d", rule_names[b->rule], ord[i]);
+        fprintf(stderr, "%-24s %10lu %10lu %10lu %10lu %6d", name, b->tries, b->fails, b->rescanned,
+        b->discarded, b->max_depth);
+        /* flag the sites behind at least a tenth of the wasted work */
+        if (b->rescanned>0 && b->rescanned*10>=rescanned)
+            fprintf(stderr, "  <- %.0f%% of rescans", (double)b->rescanned*100/(double)rescanned);
+        fprintf(stderr, "\n");
+    }
+    free(ord);
+}
+
+/*
+    Binary trace (-T<file>[,<records>]). Records go into a ring mapped
+    from the file, so the last ones survive a crash; tracedump decodes it.
+*/
+#define TRACE_RECORDS   (1<<20)
+static char *trace_path;
+static unsigned long trace_records = TRACE_RECORDS;
+static TraceHeader *trace_hdr;
+static TraceRec *trace_ring;
+static uint64_t trace_mask;
+
+/* the names that precede the records of a trace or the events of a stream */
+static StrBuf *trace_names(void)
+{
+    StrBuf *names;
+    int i;
+
+    names = strbuf_new(1024);
+    strbuf_append(names, string_file_path, (int)strlen(string_file_path)+1);
+    for (i = 0; i < rule_counter; i++)
+        strbuf_append(names, rule_names[i], (int)strlen(rule_names[i])+1);
+    for (i = 0; i < TRACE_NTOKENS; i++) {
+        if (i<SET_SIZE && (grammar_tokens&(1ULL<<i)))
+            strbuf_append(names, lex_num2print(i), (int)strlen(lex_num2print(i))+1);
+        else
+            strbuf_append(names, "", 1);
+    }
+    return names;
+}
+
+static void trace_open(void)
+{
+    StrBuf *names;
+    char *p;
+    size_t size;
+    unsigned long cap;
+    int fd, len;
+
+    names = trace_names();
+    len = (strbuf_length(names)+15) & ~15;
+    for (cap = 1; cap < trace_records; cap <<= 1)
+        ;
+    size = sizeof(TraceHeader)+len+cap*sizeof(TraceRec);
+    if ((fd=open(trace_path, O_RDWR|O_CREAT|O_TRUNC, 0644)) == -1
+    || ftruncate(fd, (off_t)size) == -1
+    || (p=mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+        DIE("cannot create trace file `%s'", trace_path);
+    close(fd);
+    trace_hdr = (TraceHeader *)p;
+    memcpy(trace_hdr->magic, TRACE_MAGIC, sizeof(trace_hdr->magic));
+    trace_hdr->capacity = (uint32_t)cap;
+    trace_hdr->names_size = (uint32_t)len;
+    trace_hdr->nrules = (uint32_t)rule_counter;
+    trace_hdr->count = 0;
+    memcpy(p+sizeof(TraceHeader), strbuf_str(names), strbuf_length(names));
+    trace_ring = (TraceRec *)(p+sizeof(TraceHeader)+len);
+    trace_mask = cap-1;
+    strbuf_destroy(names);
+}
+
+static void trace(int event, int flags, int id)
+{
+    TraceRec *r;
+
+    r = &trace_ring[trace_hdr->count++ & trace_mask];
+    r->event = (uint8_t)event;
+    r->flags = (uint8_t)flags;
+    r->depth = (uint16_t)state.verind;
+    r->id = id;
+    r->offset = (uint64_t)lex_offset();
+    r->line = (uint32_t)lex_lineno();
+}
+
+/*
+    Event stream (-E<file>). Events are encoded into ev_buf, which a
+    checkpoint rewinds like the main output, and written straight from
+    there up to where the outermost checkpoint could still take them back.
+*/
+#define EV_FLUSH    65536
+#define EV_MAX_LEN  32      /* of an encoded event */
+static char *event_path;
+static unsigned char *ev_buf;
+static long ev_max;
+
+static void ev_write(const void *p, long n)
+{
+    ssize_t w;
+
+    for (; n > 0; p = (const char *)p+w, n -= w)
+        if ((w=write(ev_fd, p, (size_t)n)) == -1)
+            DIE("cannot write to `%s'", event_path);
+}
+
+/* write the events no checkpoint can take back, if at least min bytes */
+static void ev_flush(long min)
+{
+    long n;
+
+    n = ((ev_committed != -1)?ev_committed:ev_base+ev_len)-ev_base;
+    if (n<=0 || n<min)
+        return;
+    ev_write(ev_buf, n);
+    memmove(ev_buf, ev_buf+n, (size_t)(ev_len-n));
+    ev_len -= n;
+    ev_base += n;
+}
+
+static void ev_close(void)
+{
+    ev_flush(1);
+    close(ev_fd);
+    ev_fd = -1;
+}
+
+static void ev_open(void)
+{
+    EventHeader hdr;
+    StrBuf *names;
+
+    if ((ev_fd=open(event_path, O_WRONLY|O_CREAT|O_TRUNC, 0644)) == -1)
+        DIE("cannot create event file `%s'", event_path);
+    names = trace_names();
+    memcpy(hdr.magic, EVENT_MAGIC, sizeof(hdr.magic));
+    hdr.names_size = (uint32_t)strbuf_length(names);
+    hdr.nrules = (uint32_t)rule_counter;
+    ev_write(&hdr, sizeof(hdr));
+    ev_write(strbuf_str(names), strbuf_length(names));
+    strbuf_destroy(names);
+    atexit(ev_close);
+}
+
+static unsigned char *ev_num(unsigned char *p, unsigned long v)
+{
+    for (; v >= 0x80; v >>= 7)
+        *p++ = (unsigned char)(v|0x80);
+    *p++ = (unsigned char)v;
+    return p;
+}
+
+/* id is the rule of EV_ENTER, the token of EV_TOKEN (spanning len bytes at pos) */
+static void event(int ev, int id, long pos, long len)
+{
+    unsigned char *p;
+    long gap;
+
+    if (ev_len+EV_MAX_LEN > ev_max) {
+        ev_max = ev_max*2+EV_FLUSH+EV_MAX_LEN;
+        ev_buf = realloc(ev_buf, (size_t)ev_max);
+    }
+    p = ev_buf+ev_len;
+    *p++ = (unsigned char)ev;
+    if (ev != EV_EXIT)
+        p = ev_num(p, (unsigned long)id);
+    if (ev == EV_TOKEN) {
+        gap = pos-state.evend;
+        p = ev_num(p, (gap < 0)?((unsigned long)-gap<<1)-1:(unsigned long)gap<<1);
+        p = ev_num(p, (unsigned long)len);
+        state.evend = pos+len;
+    }
+    ev_len = p-ev_buf;
+    if (ev_len >= EV_FLUSH)
+        ev_flush(EV_FLUSH/2);
+}
+
+/*
+    Callbacks on the derivation, each with the data it was added with.
+    The rules entered and the tokens matched include those of [[ ]]
+    attempts: checkpoint() is called before one, and then backtrack() if
+    it fails (after exit() with ok FALSE for the rules it leaves) or
+    commit() if it succeeds. The generated recognizers follow the same
+    contract with their REC_* macros. -v, -T and -E are hooks, added with
+    add_hooks(). A NULL callback is not called.
+*/
+struct Hooks {
+    void (*enter)(void *data, int rule);
+    void (*exit)(void *data, int rule, int ok);
+    void (*token)(void *data, int tok, long pos, long len);
+    void (*checkpoint)(void *data);
+    void (*backtrack)(void *data);
+    void (*commit)(void *data);
+    void *data;
+};
+#define MAX_HOOKS   8
+static Hooks hooks[MAX_HOOKS];
+static int nhooks;
+
+static void add_hooks(Hooks *h)
+{
+    if (nhooks >= MAX_HOOKS)
+        DIE("too many hooks");
+    hooks[nhooks++] = *h;
+}
+
+#define CALL_HOOKS(cb, ...)                                 \
+    do {                                                    \
+        Hooks *_h;                                          \
+                                                            \
+        for (_h = hooks; _h < hooks+nhooks; _h++)           \
+            if (_h->cb != NULL)                             \
+                _h->cb(_h->data, ##__VA_ARGS__);            \
+    } while (0)
+
+static void verbose_enter(void *data, int rule)
+{
+    int i;
+
+    for (i = state.verind; i; i--)
+        printf("--");
+    printf(">> replacing `%s' (%s:%d)\n", rule_names[rule], string_file_path, lex_lineno());
+}
+
+static void verbose_token(void *data, int tok, long pos, long len)
+{
+    int i;
+
+    for (i = state.verind; i; i--)
+        printf("--");
+    printf("<< matched `%s' (%s:%d)\n", lex_num2print(tok), string_file_path, lex_lineno());
+}
+
+static void trace_enter(void *data, int rule)
+{
+    trace(TR_ENTER, 0, rule);
+}
+
+static void trace_exit(void *data, int rule, int ok)
+{
+    trace(TR_EXIT, ok, rule);
+}
+
+static void trace_token(void *data, int tok, long pos, long len)
+{
+    trace(TR_MATCH, 0, tok);
+}
+
+static void ev_enter(void *data, int rule)
+{
+    event(EV_ENTER, rule, 0, 0);
+}
+
+static void ev_exit(void *data, int rule, int ok)
+{
+    event(EV_EXIT, 0, 0, 0);
+}
+
+static void ev_token(void *data, int tok, long pos, long len)
+{
+    event(EV_TOKEN, tok, pos, len);
+}
+
+/* does the input take the A side of a -k site? */
+static int la_test(LaNode *t)
+{
+    int i, tok;
+
+    for (i = 0, tok = curr_tok; ; tok = lex_peek(++i)) {
+        if (t->leaf & (1ULL<<tok))
+            return TRUE;
+        if (!(t->inner & (1ULL<<tok)))
+            return FALSE;
+        t = t->next[tok];
+    }
+}
+
+/*
+    The alternative d predicts for the input, or ALT_DEFAULT. The tokens
+    past what lex_peek() holds are scanned and then gone back over.
+*/
+static int predict(Decision *d)
+{
+    DfaState *s;
+    InState in;
+    int i, tok, scanned;
+
+    scanned = 0;
+    for (s = dfa_start(d), i = 0; s->alt == ALT_UNDECIDED; i++) {
+        if (i == 0) {
+            tok = curr_tok;
+        } else if (scanned==0 && i<=LEX_MAX_PEEK) {
+            tok = lex_peek(i);
+        } else {
+            if (scanned == 0) {
+                in = state.input;
+                in.pos = lex_token_pos();
+                predict_pin = in_pin(&in);
+            }
+            for (; scanned < i; scanned++)
+                tok = lex_get_token();
+        }
+        s = dfa_move(s, tok);
+    }
+    if (scanned > 0) {
+        set_input(&in);
+        predict_pin = -1;
+    }
+    return s->alt;
+}
+
+/*
+    Error recovery (-e[<max>]). After an unexpected token is reported, it
+    and the tokens after it are skipped up to the one that was expected,
+    one that may follow the rule being recognized, a -y token or EOF. In
+    all but the first case the rule gives up: it fails up to where it was
+    called from, which goes on as if it had been recognized. A token that
+    fails again right after is skipped silently, so one mistake gives one
+    report. The exit status tells whether there were errors.
+*/
+#define MAX_ERRORS  100
+static int max_errors;          /* 0: stop at the first error */
+static int nerrors;
+static int recovering;          /* a rule is giving up */
+static int curr_rule;           /* being recognized */
+static long last_err_pos = -1;  /* token the last recovery stopped at */
+static uint64_t sync_tokens;    /* -y */
+static char **sync_names;
+static int nsync_names;
+
+/* a -y token, by name (SEMI), keyword or string (;) */
+static int sync_token(char *s)
+{
+    const char *kw;
+    int tok;
+
+    if ((tok=lex_name2num(s)) != -1)
+        return tok;
+    for (kw = lex_keyword_iterate(TRUE); kw != NULL; kw = lex_keyword_iterate(FALSE))
+        if (strcmp(kw, s) == 0)
+            return lex_str2num(s);
+    if (!isalpha((unsigned char)s[0]) && s[0]!='_' && (tok=lex_str2num(s))!=-1)
+        return tok;
+    DIE("unknown token `%s' for -y option", s);
+    return -1;
+}
+
+static void skip_token(void)
+{
+    state.input.last_pos = lex_token_pos();
+    curr_tok = lex_get_token();
+}
+
+/* after curr_tok was found instead of expected: is expected there now? */
+static int recover(int expected)
+{
+    uint64_t sync;
+    int eof;
+
+    eof = lex_name2num("EOF");
+    if (lex_token_pos() != last_err_pos) {
+        if (nerrors == max_errors) {
+            fprintf(stderr, "%s: too many errors, giving up\n", prog_name);
+            exit(EXIT_FAILURE);
+        }
+        err(0, STR_ERR, "unexpected `%s'", lex_num2print(curr_tok));
+        ++nerrors;
+    } else if (curr_tok != eof) {
+        skip_token();
+    }
+    sync = follows[curr_rule] | sync_tokens | 1ULL<<eof;
+    while (curr_tok!=expected && !(sync & (1ULL<<curr_tok)))
+        skip_token();
+    last_err_pos = lex_token_pos();
+    if (curr_tok == expected)
+        return TRUE;
+    recovering = TRUE;
+    return FALSE;
+}
+
+/*
+    Budgets (-L). A recognition that goes over one of them stops with exit
+    status EXIT_BUDGET, so that a pathological input (nested [[ ]] trying
+    everything) costs a bounded amount of work. Steps are rule calls and
+    rollbacks are failed [[ ]] attempts; the clock is only read every
+    BUDGET_TICK steps.
+*/
+#define EXIT_BUDGET 3
+#define BUDGET_TICK 1024
+static unsigned long max_steps = ULONG_MAX, max_rollbacks = ULONG_MAX;
+static int max_depth = INT_MAX;
+static uint64_t max_time_ns;    /* 0: no deadline */
+static unsigned long steps, rollbacks;
+static unsigned long next_check = ULONG_MAX;
+static uint64_t deadline;
+
+static void parse_budgets(char *spec)
+{
+    char *name, *val, *end;
+    unsigned long n;
+
+    for (name = strtok(spec, ","); name != NULL; name = strtok(NULL, ",")) {
+        if ((val=strchr(name, '=')) == NULL)
+            DIE("invalid budget `%s' for -L option", name);
+        *val++ = '\0';
+        n = strtoul(val, &end, 10);
+        if (!isdigit((unsigned char)*val) || *end!='\0' || n==0)
+            DIE("invalid value `%s' for -L%s", val, name);
+        if (strcmp(name, "steps") == 0)
+            max_steps = n;
+        else if (strcmp(name, "rollbacks") == 0)
+            max_rollbacks = n;
+        else if (strcmp(name, "depth") == 0)
+            max_depth = (n < INT_MAX)?(int)n:INT_MAX;
+        else if (strcmp(name, "time") == 0)
+            max_time_ns = (uint64_t)n*1000000;
+        else
+            DIE("unknown budget `%s' for -L option (steps, rollbacks, depth, time)", name);
+    }
+}
+
+static void budget_start(void)
+{
+    if (max_time_ns > 0) {
+        deadline = clock_ns()+max_time_ns;
+        next_check = BUDGET_TICK;
+    }
+    if (max_steps < next_check)
+        next_check = max_steps+1;
+}
+
+static void over_budget(char *what, unsigned long limit, char *unit)
+{
+    flush_committed(1);
+    fprintf(stderr, "%s: %s:%d: %s budget of %lu%s exceeded\n", prog_name, string_file_path,
+    lex_lineno(), what, limit, unit);
+    exit(EXIT_BUDGET);
+}
+
+/* steps reached next_check */
+static void check_budgets(void)
+{
+    if (steps > max_steps)
+        over_budget("step", max_steps, "");
+    if (max_time_ns > 0) {
+        if (clock_ns() > deadline)
+            over_budget("time", (unsigned long)(max_time_ns/1000000), " ms");
+        next_check = steps+BUDGET_TICK;
+    }
+    if (max_steps < next_check)
+        next_check = max_steps+1;
+}
+
+static long out_pos(Rope *buf)
+{
+    return (buf != NULL)?buf->len:strbuf_get_pos(outbuf);
+}
+
+static int recognize(Node *n, int *gen, int bt, Rope *buf)
+{
+    int res;
+
+    switch (n->kind) {
+    case OutKind: {
+        OutOp *op, *end;
+
+        if (!state.outputting)
+            return TRUE;
+        for (op = n->attr.out.ops, end = op+n->attr.out.nops; op < end; op++) {
+            if ((op->flags&OUT_INDENT) && state.atbeg && state.outind>0)
+                out_spaces(buf, state.outind);
+            switch (op->kind) {
+            case O_VER:
+                out_append(buf, op->str, op->len);
+                state.atbeg = (op->flags&OUT_NL) != 0;
+                break;
+            case O_LAST:
+                out_append(buf, last_str, (int)strlen(last_str));
+                state.atbeg = FALSE;
+                break;
+            case O_GEN:
+                if (*gen == -1)
+                    *gen = state.gencnt++;
+                if (buf == NULL) {
+                    strbuf_append_int(outbuf, *gen);
+                } else {
+                    char tmp[16];
+
+                    out_append(buf, tmp, sprintf(tmp, "%d", *gen));
+                }
+                state.atbeg = FALSE;
+                break;
+            case O_BUF: {
+                Rope *r;
+
+                r = &frame[op->len];
+                if (buf == NULL)
+                    rope_write(r, outbuf);
+                else
+                    rope_cat(buf, r);
+                state.atbeg = (r->last == '\n');
+            }
+                break;
+            case O_INC:
+                state.outind += op->len;
+                break;
+            }
+        }
+        if (buf == NULL)
+            flush_committed(flush_size);
+        if (!bt)
+            collect_ropes();
+        res = TRUE;
+    }
+        break;
+    case CtrlKind:
+        switch (n->attr.action) {
+        case CTRL_PUSH:
+            push_input();
+            break;
+        case CTRL_POP:
+            pop_input();
+            break;
+        case CTRL_EOUT:
+            state.outputting = TRUE;
+            break;
+        case CTRL_DOUT:
+            state.outputting = FALSE;
+            break;
+        }
+        res = TRUE;
+        break;
+    case TermKind:
+        if (curr_tok != n->attr.tok.num) {
+            res = FALSE;
+            if (bt)
+                break;
+            strbuf_flush(outbuf);
+            if (max_errors == 0)
+                err(1, STR_ERR, "unexpected `%s'", lex_num2print(curr_tok));
+            if (!recover(n->attr.tok.num))
+                break;
+        }
+        state.input.last_pos = lex_token_pos();
+        if (nhooks > 0)
+            CALL_HOOKS(token, curr_tok, state.input.last_pos, lex_offset()-state.input.last_pos);
+        curr_tok = lex_get_token();
+        ++tokens_matched;
+        res = TRUE;
+        break;
+    case NonTermKind: {
+        int _gen, caller_rule;
+        Rope *caller;
+        FrameMark fm;
+
+        if (nhooks > 0)
+            CALL_HOOKS(enter, n->attr.rule.num);
+        if (++state.verind > max_depth)
+            over_budget("depth", (unsigned long)max_depth, "");
+        if (++steps >= next_check)
+            check_budgets();
+        _gen = -1;
+        if (n->attr.rule.buf != -1) {
+            buf = &frame[n->attr.rule.buf];
+            rope_init(buf);
+        }
+        caller = frame;
+        caller_rule = curr_rule;
+        curr_rule = n->attr.rule.num;
+        if (rule_nbufs[n->attr.rule.num] > 0)
+            frame_push(rule_nbufs[n->attr.rule.num], &fm);
+        if (profiling) {
+            prof_enter(n->attr.rule.num);
+            res = recognize(rules[n->attr.rule.num], &_gen, bt, buf);
+            prof_exit();
+        } else {
+            res = recognize(rules[n->attr.rule.num], &_gen, bt, buf);
+        }
+        if (rule_nbufs[n->attr.rule.num] > 0) {
+            frame_pop(&fm);
+            frame = caller;
+        }
+        curr_rule = caller_rule;
+        if (recovering) {
+            recovering = FALSE;
+            res = TRUE;
+        }
+        --state.verind;
+        if (nhooks > 0)
+            CALL_HOOKS(exit, n->attr.rule.num, res);
+    }
+        break;
+    case OpKind:
+        switch (n->attr.op.tok) {
+        case TOK_ALTER: {    /* | */
+            int alt;
+
+            if (n->attr.op.chain != NULL) {
+                Chain *c;
+                int i;
+
+                c = n->attr.op.chain;
+                for (i = 0; i<c->nalts-1 && !(first(c->alts[c->order[i]]) & (1ULL<<curr_tok)); i++)
+                    ;
+                alt = c->order[i];
+                ++c->counts[alt];
+                res = recognize(c->alts[alt], gen, bt, buf);
+            } else if (n->attr.op.dec!=NULL && (alt=predict(n->attr.op.dec))!=ALT_DEFAULT) {
+                res = recognize(n->attr.op.dec->alts[alt], gen, bt, buf);
+            } else if (first(n->attr.op.child[0]) & (1ULL<<curr_tok)) {
+                res = recognize(n->attr.op.child[0], gen, bt, buf);
+            } else {
+                res = recognize(n->attr.op.child[1], gen, bt, buf);
+            }
+        }
+            break;
+        case TOK_ALTER_BT: { /* [[ | ]] */
+            State st;
+            BtSite *la;
+
+            la = &bt_sites[n->attr.op.site];
+            if (la->la!=NULL && (!la->la_follow || !bt)) {
+                if (la_test(la->la))
+                    res = recognize(n->attr.op.child[0], gen, bt, buf);
+                else
+                    res = recognize(n->attr.op.child[1], gen, bt, buf);
+                break;
+            }
+            res = FALSE;
+            save_state(&st, buf);
+            if (first(n->attr.op.child[0]) & (1ULL<<curr_tok)) {
+                BtSite *site;
+                unsigned long t, tok;
+                long pos;
+
+                site = NULL;
+                t = tok = 0;
+                pos = 0;
+                if (bt_stats) {
+                    site = &bt_sites[n->attr.op.site];
+                    site->tries++;
+                    if (++bt_nesting > site->max_depth)
+                        site->max_depth = bt_nesting;
+                    t = prof_samples;
+                    tok = tokens_matched;
+                    pos = out_pos(buf);
+                }
+                if (nhooks > 0)
+                    CALL_HOOKS(checkpoint);
+                res = recognize(n->attr.op.child[0], gen, TRUE, buf);
+                if (site != NULL) {
+                    --bt_nesting;
+                    if (!res) {
+                        site->fails++;
+                        site->fail_time += prof_samples-t;
+                        site->rescanned += tokens_matched-tok;
+                        site->discarded += out_pos(buf)-pos;
+                    }
+                }
+                if (!res) {
+                    restore_state(&st, buf);
+                    if (++rollbacks > max_rollbacks)
+                        over_budget("rollback", max_rollbacks, "");
+                }
+                if (nhooks > 0) {
+                    if (res)
+                        CALL_HOOKS(commit);
+                    else
+                        CALL_HOOKS(backtrack);
+                }
+            }
+            /*
+                The second alternative needs no checkpoint: if it fails, an
+                enclosing one rewinds further back (or it is an error).
+            */
+            dispose_state(&st);
+            if (!res)
+                res = recognize(n->attr.op.child[1], gen, bt, buf);
+        }
+            break;
+        case TOK_CONCAT:     /*   */
+            if (res = recognize(n->attr.op.child[0], gen, bt, buf))
+                res = recognize(n->attr.op.child[1], gen, bt, buf);
+            break;
+        case TOK_REPET:      /* {} */
+            res = TRUE;
+            while (res && (first(n->attr.op.child[0]) & (1ULL<<curr_tok)))
+                res = recognize(n->attr.op.child[0], gen, bt, buf);
+            break;
+        case TOK_OPTION:     /* [] */
+            res = TRUE;
+            if (first(n->attr.op.child[0]) & (1ULL<<curr_tok))
+                res = recognize(n->attr.op.child[0], gen, bt, buf);
+            break;
+        }
+        break;
+    }
+    return res;
+}
+
+/* ============================================================ */
+/* Random sentence generator                                    */
+/* ============================================================ */
+
+/*
+    -r<size> writes a random sentence of the language to stdout. Choices
+    mirror the decisions the recognizer makes: an alternative or another
+    iteration is only taken if its first token is one the recognizer would
+    direct there, so the output can be read back by genrec and by -g
+    recognizers (grammars with unresolved conflicts aside). Once past
+    RANDOM_DEPTH nested rules, or once <size> bytes have been written, the
+    shortest way out is taken.
+*/
+#define RANDOM_DEPTH    24
+#define NPOOL_IDS       256
+#define INF_HEIGHT      (1<<30)
+static long random_size;
+static uint64_t random_seed = 1;
+static long random_written;
+static int random_col, random_depth, random_repet;
+static struct {
+    long pos;
+    int col;
+    long written;
+} *random_marks; /* $push */
+static int random_top, random_marks_size;
+static int tok_id, tok_num, tok_str1, tok_str2, tok_eof;
+static int *min_height;
+static char *id_pool[NPOOL_IDS];
+
+static uint64_t rnd(void)
+{
+    /* xorshift64* */
+    random_seed ^= random_seed>>12;
+    random_seed ^= random_seed<<25;
+    random_seed ^= random_seed>>27;
+    return random_seed*2685821657736338717ULL;
+}
+
+#define rnd_n(n)    ((int)(rnd()%(uint64_t)(n)))
+
+/* height of the shortest derivation of n */
+static int height(Node *n)
+{
+    int h0, h1;
+
+    switch (n->kind) {
+    case TermKind:
+    case OutKind:
+    case CtrlKind:
+        return 0;
+    case NonTermKind:
+        h0 = min_height[n->attr.rule.num];
+        return (h0 < INF_HEIGHT)?h0+1:INF_HEIGHT;
+    case OpKind:
+        switch (n->attr.op.tok) {
+        case TOK_ALTER:
+        case TOK_ALTER_BT:
+            h0 = height(n->attr.op.child[0]);
+            h1 = height(n->attr.op.child[1]);
+            return (h0 < h1)?h0:h1;
+        case TOK_CONCAT:
+            h0 = height(n->attr.op.child[0]);
+            h1 = height(n->attr.op.child[1]);
+            return (h0 > h1)?h0:h1;
+        default: /* {} [] */
+            return 0;
+        }
+    }
+    return 0;
+}
+
+static void compute_min_heights(void)
+{
+    int i, h, changed;
+
+    min_height = malloc(rule_counter*sizeof(*min_height));
+    for (i = 0; i < rule_counter; i++)
+        min_height[i] = INF_HEIGHT;
+    do {
+        changed = FALSE;
+        for (i = 0; i < rule_counter; i++) {
+            if ((h=height(rules[i])) < min_height[i]) {
+                min_height[i] = h;
+                changed = TRUE;
+            }
+        }
+    } while (changed);
+}
+
+static int is_keyword_str(const char *s)
+{
+    const char *kw;
+
+    for (kw = lex_keyword_iterate(TRUE); kw != NULL; kw = lex_keyword_iterate(FALSE))
+        if (strcmp(kw, s) == 0)
+            return TRUE;
+    return FALSE;
+}
+
+static void init_id_pool(void)
+{
+    static const char alpha[] = "abcdefghijklmnopqrstuvwxyz_";
+    static const char alnum[] = "abcdefghijklmnopqrstuvwxyz0123456789_";
+    char s[16];
+    int i, j, len;
+
+    for (i = 0; i < NPOOL_IDS; i++) {
+        do {
+            len = 1+rnd_n(8);
+            s[0] = alpha[rnd_n(sizeof(alpha)-1)];
+            for (j = 1; j < len; j++)
+                s[j] = alnum[rnd_n(sizeof(alnum)-1)];
+            s[len] = '\0';
+        } while (is_keyword_str(s));
+        id_pool[i] = strdup(s);
+    }
+}
+
+static void random_token(int tok)
+{
+    char s[64];
+    const char *p;
+    int i, len;
+
+    p = s;
+    if (tok == tok_id) {
+        p = id_pool[rnd_n(NPOOL_IDS)];
+    } else if (tok == tok_num) {
+        sprintf(s, "%d", (rnd_n(4) == 0)?rnd_n(1000000):rnd_n(100));
+    } else if (tok==tok_str2 || tok==tok_str1) {
+        s[0] = (tok == tok_str2)?'"':'\'';
+        len = rnd_n(20);
+        for (i = 1; i <= len; i++)
+            s[i] = (rnd_n(6) == 0)?' ':(char)('a'+rnd_n(26));
+        s[i++] = s[0];
+        s[i] = '\0';
+    } else {
+        static const char *text[SET_SIZE];
+
+        if (text[tok] == NULL) {
+            text[tok] = lex_num2print(tok);
+            if (tok==tok_eof || (!lex_is_keyword(tok) && text[tok]==lex_num2name(tok)))
+                text[tok] = ""; /* EOF, UNKNOWN, ... */
+        }
+        if (*(p=text[tok]) == '\0')
+            return;
+    }
+    len = (int)strlen(p);
+    if (random_col > 0) {
+        if (random_col+len >= 80) {
+            strbuf_append(outbuf, "\n", 1);
+            random_col = 0;
+        } else {
+            strbuf_append(outbuf, " ", 1);
+            ++random_col;
+        }
+    }
+    strbuf_append(outbuf, p, len);
+    random_col += len;
+    random_written += len+1;
+    if (random_top==0 && strbuf_length(outbuf)>=OUT_FLUSH_SIZE)
+        strbuf_flush(outbuf);
+}
+
+/* TRUE if the sentence can stop growing */
+#define random_done()   (random_depth>=RANDOM_DEPTH || random_written>=random_size)
+
+/*
+    Generate a derivation of n whose first token is not in avoid. Returns
+    the tokens the next one must avoid (none if n produced a token).
+*/
+static uint64_t random_derive(Node *n, uint64_t avoid)
+{
+    switch (n->kind) {
+    case TermKind:
+        random_token(n->attr.tok.num);
+        return EMPTY_SET;
+    case NonTermKind:
+        ++random_depth;
+        avoid = random_derive(rules[n->attr.rule.num], avoid);
+        --random_depth;
+        return avoid;
+    case OpKind:
+        switch (n->attr.op.tok) {
+        case TOK_ALTER:
+        case TOK_ALTER_BT: {
+            Node *alts[64], *q;
+            uint64_t seen;
+            int i, k, nalts, ok[64], nok;
+
+            /* the chain is nested to the left: ((a | b) | c) */
+            nalts = 0;
+            for (q = n; q->kind==OpKind && q->attr.op.tok==n->attr.op.tok && nalts<63; q = q->attr.op.child[0])
+                alts[nalts++] = q->attr.op.child[1];
+            alts[nalts++] = q;
+            for (i = 0; i < nalts/2; i++) {
+                q = alts[i];
+                alts[i] = alts[nalts-1-i];
+                alts[nalts-1-i] = q;
+            }
+            /*
+                Without backtracking, the recognizer takes the first
+                alternative whose first set contains the token.
+            */
+            nok = 0;
+            seen = avoid;
+            for (i = 0; i < nalts; i++) {
+                uint64_t f;
+
+                f = first(alts[i]);
+                if ((f&EMPTY) || (f&~seen&~EMPTY)!=EMPTY_SET)
+                    ok[nok++] = i;
+                if (n->attr.op.tok == TOK_ALTER)
+                    seen |= f&~EMPTY;
+            }
+            if (nok == 0) {
+                k = 0;
+            } else if (random_done()) {
+                for (k = ok[0], i = 1; i < nok; i++)
+                    if (height(alts[ok[i]]) < height(alts[k]))
+                        k = ok[i];
+            } else {
+                k = ok[rnd_n(nok)];
+            }
+            if (n->attr.op.tok == TOK_ALTER)
+                for (i = 0; i < k; i++)
+                    avoid |= first(alts[i])&~EMPTY;
+            return random_derive(alts[k], avoid);
+        }
+        case TOK_CONCAT:
+            avoid = random_derive(n->attr.op.child[0], avoid);
+            return random_derive(n->attr.op.child[1], avoid);
+        case TOK_REPET:
+        case TOK_OPTION: {
+            uint64_t f;
+            int outer;
+
+            f = first(n->attr.op.child[0]);
+            outer = (random_repet == 0);
+            if (n->attr.op.tok == TOK_REPET)
+                ++random_repet;
+            /*
+                The outermost repetition goes on until the size is reached
+                (and options are taken until there is one).
+            */
+            while ((f&~avoid&~EMPTY) != EMPTY_SET && !random_done()
+            && (outer || rnd_n(2))) {
+                avoid = random_derive(n->attr.op.child[0], avoid);
+                if (n->attr.op.tok == TOK_OPTION)
+                    break;
+            }
+            if (n->attr.op.tok == TOK_REPET)
+                --random_repet;
+            return avoid|(f&~EMPTY);
+        }
+        }
+        break;
+    case CtrlKind:
+        /* $pop rewinds the input, so drop what was written since $push */
+        if (n->attr.action == CTRL_PUSH) {
+            if (random_top >= random_marks_size) {
+                random_marks_size = random_marks_size*2+16;
+                random_marks = realloc(random_marks, random_marks_size*sizeof(*random_marks));
+            }
+            random_marks[random_top].pos = strbuf_get_pos(outbuf);
+            random_marks[random_top].col = random_col;
+            random_marks[random_top].written = random_written;
+            ++random_top;
+        } else if (n->attr.action==CTRL_POP && random_top>0) {
+            --random_top;
+            strbuf_set_pos(outbuf, random_marks[random_top].pos);
+            random_col = random_marks[random_top].col;
+            random_written = random_marks[random_top].written;
+        }
+        break;
+    default: /* OutKind */
+        break;
+    }
+    return avoid;
+}
+
+static void random_sentence(void)
+{
+    compute_min_heights();
+    if (min_height[start_symbol] >= INF_HEIGHT)
+        err(1, GRA_ERR, "the start symbol does not derive any sentence");
+    tok_id = lex_name2num("ID");
+    tok_num = lex_name2num("NUM");
+    tok_str1 = lex_name2num("STR1");
+    tok_str2 = lex_name2num("STR2");
+    tok_eof = lex_name2num("EOF");
+    init_id_pool();
+    outbuf = strbuf_new(OUT_FLUSH_SIZE+MAX_TOKSTR_LEN);
+    random_derive(rules[start_symbol], EMPTY_SET);
+    strbuf_append(outbuf, "\n", 1);
+    strbuf_flush(outbuf);
+    strbuf_destroy(outbuf);
+}
+
+/* ============================================================ */
+/* Source code emitters                                         */
 /* ============================================================ */
 
 static void emit(int indent, int new_line, char *fmt, ...)
@@ -1056,6 +3788,18 @@ static void emit(int indent, int new_line, char *fmt, ...)
 #define EMIT(indent, ...)   emit(indent, 0, __VA_ARGS__)
 #define EMITLN(indent, ...) emit(indent, 1, __VA_ARGS__)
 
+/* name of the macro that stands for token num in generated code */
+static const char *tok_macro(int num)
+{
+    static char buf[4][MAX_TOKSTR_LEN+2];
+    static int n;
+    char *p;
+
+    p = buf[n++%4];
+    sprintf(p, "%c_%s", lex_is_keyword(num)?'K':'T', lex_num2name(num));
+    return p;
+}
+
 static void write_first_test(uint64_t s)
 {
     int i, start;
@@ -1065,20 +3809,96 @@ static void write_first_test(uint64_t s)
         if (s & (1ULL<<i)) {
             if (!start)
                 fprintf(rec_file, " || ");
-            fprintf(rec_file, "LA(T_%s)", lex_num2name(i));
+            fprintf(rec_file, "LA(%s)", tok_macro(i));
             start = FALSE;
         }
     }
 }
 
+/* write s as the contents of a C string literal */
+static void write_cstr(char *s)
+{
+    for (; *s != '\0'; s++) {
+        switch (*s) {
+        case '\n':
+            fprintf(rec_file, "\\n");
+            break;
+        case '\"':
+            fprintf(rec_file, "\\\"");
+            break;
+        case '\\':
+            fprintf(rec_file, "\\\\");
+            break;
+        default:
+            fputc(*s, rec_file);
+            break;
+        }
+    }
+}
+
+static void write_call(Node *n, int indent)
+{
+    if (n->attr.rule.buf == -1) {
+        EMIT(indent, "rule_%s();", rule_names[n->attr.rule.num]);
+        return;
+    }
+    EMITLN(indent, "{");
+    EMITLN(indent+1, "Buf *_out = out;");
+    fprintf(rec_file, "\n");
+    EMITLN(indent+1, "out = &nb[%d];", n->attr.rule.buf);
+    EMITLN(indent+1, "out->pos = 0;");
+    EMITLN(indent+1, "rule_%s();", rule_names[n->attr.rule.num]);
+    EMITLN(indent+1, "out = _out;");
+    EMIT(indent, "}");
+}
+
+/*
+    Compile an output action into put_*() calls. Whether the output is at
+    the beginning of a line is tracked at generation time where it can be
+    known (atbeg: 1/0, -1 when only known at run time), so indentation is
+    only tested where it may be needed.
+*/
+static void write_out_ops(OutOp *op, int nops, int indent)
+{
+    int atbeg;
+    OutOp *end;
+
+    atbeg = -1;
+    for (end = op+nops; op < end; op++) {
+        if ((op->flags&OUT_INDENT) && atbeg!=0)
+            EMITLN(indent, (atbeg == 1)?"put_spaces();":"put_indent();");
+        switch (op->kind) {
+        case O_VER:
+            EMIT(indent, "put_mem(\"");
+            write_cstr(op->str);
+            fprintf(rec_file, "\", %d);\n", op->len);
+            atbeg = (op->flags&OUT_NL) != 0;
+            break;
+        case O_LAST:
+            EMITLN(indent, "put_last();");
+            atbeg = FALSE;
+            break;
+        case O_GEN:
+            EMITLN(indent, "put_num(gennum(&_gen));");
+            atbeg = FALSE;
+            break;
+        case O_BUF:
+            EMITLN(indent, "put_buf(&nb[%d]);", op->len);
+            atbeg = -1;
+            break;
+        case O_INC:
+            EMITLN(indent, "indent += %d;", op->len);
+            break;
+        }
+    }
+    if (atbeg != -1)
+        EMITLN(indent, "atbeg = %d;", atbeg);
+}
+
 static void write_rule(Node *n, int in_alter, int in_else, int indent)
 {
     switch (n->kind) {
-    case OutKind: {
-        OutList *t;
-        char fmtbuf[2048], argbuf[1024];
-        int toadd;
-
+    case OutKind:
         if (in_alter) {
             if (in_else)
                 fprintf(rec_file, "if (1) {\n");
@@ -1086,101 +3906,59 @@ static void write_rule(Node *n, int in_alter, int in_else, int indent)
                 EMITLN(indent, "if (1) {");
             ++indent;
         }
-
-        toadd = 0;
-        fmtbuf[0] = argbuf[0] = '\0';
-        for (t = n->attr.out_list; t != NULL; t = t->next) {
-            switch (t->kind) {
-            case O_LAST:
-                strcat(fmtbuf, "%s");
-                strcat(argbuf, ", last_tokstr");
-                break;
-            case O_GEN:
-                strcat(fmtbuf, "%d");
-                strcat(argbuf, ", gennum(&_gen)");
-                break;
-            case O_INC:
-                if (fmtbuf[0] == '\0')
-                    EMITLN(indent, "indent += 4;");
-                else
-                    toadd += 4;
-                break;
-            case O_DEC:
-                if (fmtbuf[0] == '\0')
-                    EMITLN(indent, "indent += -4;");
-                else
-                    toadd -= 4;
-                break;
-            case O_END:
-                EMIT(indent, "printf(\"%%*s%s\\n\", get_indent(), \"\"%s);", fmtbuf, argbuf);
-                if (toadd != 0) {
-                    fprintf(rec_file, "\n");
-                    EMIT(indent, "indent += %d;", toadd);
-                    toadd = 0;
-                }
-                if (t->next != NULL)
-                    fprintf(rec_file, "\n");
-                fmtbuf[0] = argbuf[0] = '\0';
-                break;
-            case O_VER: {
-                char *x, *y;
-
-                x = fmtbuf+strlen(fmtbuf);
-                y = t->val;
-                while (*y != '\0') {
-                    switch (*y) {
-                    case '\n':
-                        *x++ = '\\';
-                        *x++ = 'n';
-                        break;
-                    case '\"':
-                        *x++ = '\\';
-                        *x++ = '\"';
-                        break;
-                    case '\\':
-                        *x++ = '\\';
-                        *x++ = '\\';
-                        break;
-                    default:
-                        *x++ = *y;
-                        break;
-                    }
-                    ++y;
-                }
-                *x = *y;
-            }
-                break;
-            case O_BUF:
-                DIE("not implemented: -g and >$buffer");
-                break;
-            }
+        if (uses_ctrl) {
+            EMITLN(indent, "if (outputting) {");
+            ++indent;
         }
-        if (fmtbuf[0] != '\0')
-            EMIT(indent, "printf(\"%%*s%s\", get_indent(), \"\"%s);", fmtbuf, argbuf);
-        if (toadd != 0) {
+        write_out_ops(n->attr.out.ops, n->attr.out.nops, indent);
+        EMIT(indent, "flush();");
+
+        if (uses_ctrl) {
             fprintf(rec_file, "\n");
-            EMIT(indent, "indent += %d;", toadd);
+            EMIT(--indent, "}");
         }
-
         if (in_alter) {
             fprintf(rec_file, "\n");
             EMIT(indent-1, "}");
         }
-    }
         break;
     case CtrlKind:
-        DIE("not implemented: -g and $action");
+        if (in_alter) {
+            if (in_else)
+                fprintf(rec_file, "if (1) {\n");
+            else
+                EMITLN(indent, "if (1) {");
+            ++indent;
+        }
+        switch (n->attr.action) {
+        case CTRL_PUSH:
+            EMIT(indent, "push_input();");
+            break;
+        case CTRL_POP:
+            EMIT(indent, "pop_input();");
+            break;
+        case CTRL_EOUT:
+            EMIT(indent, "outputting = 1;");
+            break;
+        case CTRL_DOUT:
+            EMIT(indent, "outputting = 0;");
+            break;
+        }
+        if (in_alter) {
+            fprintf(rec_file, "\n");
+            EMIT(indent-1, "}");
+        }
         break;
     case TermKind:
         if (in_alter) {
             if (in_else)
-                fprintf(rec_file, "if (LA(T_%s)) {\n", lex_num2name(n->attr.tok.num));
+                fprintf(rec_file, "if (LA(%s)) {\n", tok_macro(n->attr.tok.num));
             else
-                EMITLN(indent, "if (LA(T_%s)) {", lex_num2name(n->attr.tok.num));
-            EMITLN(indent+1, "match(T_%s);", lex_num2name(n->attr.tok.num));
+                EMITLN(indent, "if (LA(%s)) {", tok_macro(n->attr.tok.num));
+            EMITLN(indent+1, "match(%s);", tok_macro(n->attr.tok.num));
             EMIT(indent, "}");
         } else {
-            EMIT(indent, "match(T_%s);", lex_num2name(n->attr.tok.num));
+            EMIT(indent, "match(%s);", tok_macro(n->attr.tok.num));
         }
         break;
     case NonTermKind:
@@ -1191,15 +3969,30 @@ static void write_rule(Node *n, int in_alter, int in_else, int indent)
                 EMIT(indent, "if (");
             write_first_test(first(rules[n->attr.rule.num]));
             fprintf(rec_file, ") {\n");
-            EMITLN(indent+1, "rule_%s();", rule_names[n->attr.rule.num]);
+            write_call(n, indent+1); fprintf(rec_file, "\n");
             EMIT(indent, "}");
         } else {
-            EMIT(indent, "rule_%s();", rule_names[n->attr.rule.num]);
+            write_call(n, indent);
         }
         break;
     case OpKind:
         switch (n->attr.op.tok) {
         case TOK_ALTER:      /* | */
+            if (n->attr.op.chain != NULL) {
+                Chain *c;
+                int i;
+
+                c = n->attr.op.chain;
+                for (i = 0; i < c->nalts-1; i++) {
+                    if (i > 0)
+                        fprintf(rec_file, " else ");
+                    write_rule(c->alts[c->order[i]], TRUE, i>0, indent);
+                }
+                fprintf(rec_file, " else {\n");
+                write_rule(c->alts[c->order[i]], FALSE, FALSE, indent+1); fprintf(rec_file, "\n");
+                EMIT(indent, "}");
+                break;
+            }
             write_rule(n->attr.op.child[0], TRUE, FALSE, indent);
             if (in_alter) {
                 fprintf(rec_file, " else ");
@@ -1210,8 +4003,74 @@ static void write_rule(Node *n, int in_alter, int in_else, int indent)
                 EMIT(indent, "}");
             }
             break;
-        case TOK_ALTER_BT:   /* [[ | ]] */
-            DIE("not implemented: -g and [[...]]");
+        case TOK_ALTER_BT: { /* [[ | ]] */
+            BtSite *la;
+            int cp;
+
+            if (in_alter) {
+                if (in_else)
+                    fprintf(rec_file, "if (");
+                else
+                    EMIT(indent, "if (");
+                write_first_test(first(n));
+                fprintf(rec_file, ") {\n");
+                ++indent;
+            }
+            la = &bt_sites[n->attr.op.site];
+            if (la->la != NULL) {
+                if (la->la_follow) {
+                    EMITLN(indent, "if (bt_top == NULL) {");
+                    ++indent;
+                }
+                EMITLN(indent, "if (la_site%d()) {", n->attr.op.site);
+                write_rule(n->attr.op.child[0], FALSE, FALSE, indent+1); fprintf(rec_file, "\n");
+                EMITLN(indent, "} else {");
+                write_rule(n->attr.op.child[1], FALSE, FALSE, indent+1); fprintf(rec_file, "\n");
+                EMIT(indent, "}");
+                if (!la->la_follow) {
+                    if (in_alter) {
+                        fprintf(rec_file, "\n");
+                        EMIT(indent-1, "}");
+                    }
+                    break;
+                }
+                fprintf(rec_file, "\n");
+                EMITLN(--indent, "} else {");
+                ++indent;
+            }
+            /*
+                The first alternative runs under a checkpoint. A failure
+                inside it longjmp()s back here with the state restored.
+            */
+            cp = ++checkpoint_counter;
+            EMITLN(indent, "{");
+            EMITLN(indent+1, "Checkpoint _cp%d;", cp);
+            fprintf(rec_file, "\n");
+            EMITLN(indent+1, "checkpoint(&_cp%d);", cp);
+            EMITLN(indent+1, "if (setjmp(_cp%d.env) == 0) {", cp);
+            if ((first(n->attr.op.child[0]) & ~EMPTY) != EMPTY_SET) {
+                EMIT(indent+2, "if (!(");
+                write_first_test(first(n->attr.op.child[0]));
+                fprintf(rec_file, "))\n");
+                EMITLN(indent+3, "backtrack();");
+            } else {
+                EMITLN(indent+2, "backtrack();");
+            }
+            write_rule(n->attr.op.child[0], FALSE, FALSE, indent+2); fprintf(rec_file, "\n");
+            EMITLN(indent+2, "commit(&_cp%d);", cp);
+            EMITLN(indent+1, "} else {");
+            write_rule(n->attr.op.child[1], FALSE, FALSE, indent+2); fprintf(rec_file, "\n");
+            EMITLN(indent+1, "}");
+            EMIT(indent, "}");
+            if (la->la != NULL) {
+                fprintf(rec_file, "\n");
+                EMIT(--indent, "}");
+            }
+            if (in_alter) {
+                fprintf(rec_file, "\n");
+                EMIT(indent-1, "}");
+            }
+        }
             break;
         case TOK_CONCAT:     /*   */
             if (in_alter) {
@@ -1266,6 +4125,499 @@ static void write_rule(Node *n, int in_alter, int in_else, int indent)
     }
 }
 
+static void write_la_switch(LaNode *t, int depth, int indent)
+{
+    int i;
+
+    if (depth == 0)
+        EMITLN(indent, "switch (curr_tok) {");
+    else
+        EMITLN(indent, "switch (peek(%d)) {", depth);
+    if (t->leaf != EMPTY_SET) {
+        for (i = 0; i < SET_SIZE; i++)
+            if (t->leaf & (1ULL<<i))
+                EMITLN(indent, "case %s:", tok_macro(i));
+        EMITLN(indent+1, "return 1;");
+    }
+    for (i = 0; i < SET_SIZE; i++) {
+        if (t->inner & (1ULL<<i)) {
+            EMITLN(indent, "case %s:", tok_macro(i));
+            write_la_switch(t->next[i], depth+1, indent+1);
+            EMITLN(indent+1, "break;");
+        }
+    }
+    EMITLN(indent, "}");
+}
+
+/* the tests of the [[ ]] sites that -k decided */
+static void write_la_tests(void)
+{
+    int i, peeks;
+
+    for (i = peeks = 0; i < bt_site_counter; i++)
+        if (bt_sites[i].la != NULL && bt_sites[i].la_k > 1)
+            peeks = TRUE;
+    if (peeks && spec_lexer) {
+        fprintf(rec_file,
+        "static int peek(int n)\n"
+        "{\n"
+        "    LexMark m;\n"
+        "    int tok;\n"
+        "\n"
+        "    lex_save(&m);\n"
+        "    while (n-- > 0)\n"
+        "        tok = next_token();\n"
+        "    lex_restore(&m);\n"
+        "    return tok;\n"
+        "}\n");
+    } else if (peeks) {
+        fprintf(rec_file, "#define peek(n) lex_peek(n)\n");
+    }
+    for (i = 0; i < bt_site_counter; i++) {
+        if (bt_sites[i].la == NULL)
+            continue;
+        EMITLN(0, "/* [[ ]] in `%s': %d token%s of lookahead */", rule_names[bt_sites[i].rule],
+        bt_sites[i].la_k, (bt_sites[i].la_k > 1)?"s":"");
+        EMITLN(0, "static int la_site%d(void)", i);
+        EMITLN(0, "{");
+        write_la_switch(bt_sites[i].la, 0, 1);
+        EMITLN(1, "return 0;");
+        EMITLN(0, "}");
+    }
+}
+
+/*
+    Operators recognized by lex_get_token(). The specialized lexer
+    (-s) must split the input exactly like lex.c does.
+*/
+static struct {
+    char c, c2;
+    char *tok, *tok2;
+} lex_ops[] = {
+    { '(', 0, "LPAREN" },
+    { ')', 0, "RPAREN" },
+    { '/', 0, "DIV" },
+    { '*', 0, "MUL" },
+    { '+', 0, "PLUS" },
+    { '-', 0, "MINUS" },
+    { '#', 0, "NEQ" },
+    { '=', 0, "EQ" },
+    { ',', 0, "COMMA" },
+    { ';', 0, "SEMI" },
+    { '.', 0, "DOT" },
+    { '|', 0, "VBAR" },
+    { '$', 0, "DOLLAR" },
+    { '^', 0, "CARET" },
+    { '>', '=', "GT", "GET" },
+    { '<', '=', "LT", "LET" },
+    { '{', '{', "LBRACE", "LBRACE2" },
+    { '}', '}', "RBRACE", "RBRACE2" },
+    { '[', '[', "LBRACKET", "LBRACKET2" },
+    { ']', ']', "RBRACKET", "RBRACKET2" },
+    { ':', '=', "COLON", "ASSIGN" },
+    { 0 },
+};
+
+static uint64_t lexer_tokens; /* tokens the specialized lexer tells apart */
+
+/* macro for token name, or T_OTHER if the grammar does not use it */
+static const char *lex_macro(const char *name)
+{
+    int num;
+
+    num = lex_name2num(name);
+    return (lexer_tokens & (1ULL<<num))?tok_macro(num):"T_OTHER";
+}
+
+static int kwcmp(const void *a, const void *b)
+{
+    return strcmp(*(char **)a, *(char **)b);
+}
+
+/* emit a trie (nested switches) over keywords kw[0..n-1], all of length len */
+static void write_kw_trie(const char **kw, int n, int depth, int len, int indent)
+{
+    int i, j;
+
+    if (n == 1) {
+        if (depth < len) {
+            EMIT(indent, "if (memcmp(s+%d, \"%s\", %d) == 0)\n", depth, kw[0]+depth, len-depth);
+            EMITLN(indent+1, "return %s;", tok_macro(lex_str2num(kw[0])));
+        } else {
+            EMITLN(indent, "return %s;", tok_macro(lex_str2num(kw[0])));
+        }
+        return;
+    }
+    EMITLN(indent, "switch (s[%d]) {", depth);
+    for (i = 0; i < n; i = j) {
+        for (j = i+1; j<n && kw[j][depth]==kw[i][depth]; j++)
+            ;
+        EMITLN(indent, "case '%c':", kw[i][depth]);
+        write_kw_trie(kw+i, j-i, depth+1, len, indent+1);
+        EMITLN(indent+1, "break;");
+    }
+    EMITLN(indent, "}");
+}
+
+/*
+    Emit a lexer specialized to the tokens the grammar uses. Tokens the
+    grammar never mentions are still scanned (so the input is split the
+    same way) but all come out as T_OTHER. Keywords are resolved by a
+    trie over the identifier just scanned.
+*/
+static void write_lexer(void)
+{
+    int i, n, len, maxlen;
+    const char *kw, **kws;
+
+    EMITLN(0, "#define T_OTHER (-2)");
+    EMITLN(0, "enum { C_OTHER, C_SPACE, C_ALPHA, C_DIGIT };");
+    EMITLN(0, "static const unsigned char cclass[256] = {");
+    for (i = 0; i < 256; i++) {
+        int cls;
+
+        if (i==' ' || i=='\t' || i=='\n')
+            cls = 1;
+        else if (i < 128 && (isalpha(i) || i=='_'))
+            cls = 2;
+        else if (i < 128 && isdigit(i))
+            cls = 3;
+        else
+            cls = 0;
+        fprintf(rec_file, "%s%d,%s", (i%16 == 0)?"    ":"", cls, (i%16 == 15)?"\n":" ");
+    }
+    EMITLN(0, "};");
+    fprintf(rec_file,
+    "static char *lex_buf, *lex_curr, *tok_begin;\n"
+    "static int tok_len;\n");
+
+    /* keywords, grouped by length and sorted */
+    for (n = 0, kw = lex_keyword_iterate(TRUE); kw != NULL; kw = lex_keyword_iterate(FALSE))
+        ++n;
+    kws = malloc((n+1)*sizeof(*kws));
+    for (n = maxlen = 0, kw = lex_keyword_iterate(TRUE); kw != NULL; kw = lex_keyword_iterate(FALSE)) {
+        kws[n++] = kw;
+        if ((int)strlen(kw) > maxlen)
+            maxlen = (int)strlen(kw);
+    }
+    qsort(kws, n, sizeof(*kws), kwcmp);
+    EMITLN(0, "static int kw_lookup(const char *s, int len)");
+    EMITLN(0, "{");
+    if (n > 0) {
+        const char **grp;
+
+        grp = malloc(n*sizeof(*grp));
+        EMITLN(1, "switch (len) {");
+        for (len = 1; len <= maxlen; len++) {
+            int m;
+
+            for (m = i = 0; i < n; i++)
+                if ((int)strlen(kws[i]) == len)
+                    grp[m++] = kws[i];
+            if (m == 0)
+                continue;
+            EMITLN(1, "case %d:", len);
+            write_kw_trie(grp, m, 0, len, 2);
+            EMITLN(2, "break;");
+        }
+        EMITLN(1, "}");
+        free(grp);
+    }
+    EMITLN(1, "return %s;", lex_macro("ID"));
+    EMITLN(0, "}");
+    free(kws);
+
+    fprintf(rec_file,
+    "static int scan_str(const char *p, int q)\n"
+    "{\n"
+    "    for (; *p != q || p[-1] == '\\\\'; p++) {\n"
+    "        if (*p == '\\0') {\n"
+    "            lex_curr = tok_begin+1; /* the quote alone */\n"
+    "            tok_len = 0;\n"
+    "            return 0;\n"
+    "        }\n"
+    "    }\n"
+    "    lex_curr = (char *)p+1;\n"
+    "    tok_len = (int)(lex_curr-tok_begin);\n"
+    "    return 1;\n"
+    "}\n"
+    "static inline int next_token(void)\n"
+    "{\n"
+    "    const unsigned char *p;\n"
+    "\n"
+    "    p = (const unsigned char *)lex_curr;\n"
+    "    while (cclass[*p] == C_SPACE)\n"
+    "        ++p;\n"
+    "    tok_begin = (char *)p;\n"
+    "    tok_len = 0;\n"
+    "    switch (cclass[*p]) {\n"
+    "    case C_ALPHA:\n"
+    "        do\n"
+    "            ++p;\n"
+    "        while (cclass[*p] >= C_ALPHA);\n"
+    "        lex_curr = (char *)p;\n"
+    "        tok_len = (int)(lex_curr-tok_begin);\n"
+    "        return kw_lookup(tok_begin, tok_len);\n"
+    "    case C_DIGIT:\n"
+    "        do\n"
+    "            ++p;\n"
+    "        while (cclass[*p] == C_DIGIT);\n"
+    "        lex_curr = (char *)p;\n"
+    "        tok_len = (int)(lex_curr-tok_begin);\n"
+    "        return %s;\n"
+    "    }\n"
+    "    lex_curr = (char *)p+1;\n"
+    "    switch (*p) {\n"
+    "    case '\\0':\n"
+    "        lex_curr = (char *)p;\n"
+    "        return %s;\n",
+    lex_macro("NUM"), lex_macro("EOF"));
+    for (i = 0; i < 2; i++) {
+        const char *str;
+
+        str = lex_macro(i?"STR2":"STR1");
+        EMITLN(1, "case '%s':", i?"\"":"\\'");
+        if (strcmp(str, lex_macro("UNKNOWN")) != 0) {
+            EMITLN(2, "return scan_str((char *)p+1, '%s')?%s:%s;", i?"\"":"\\'", str, lex_macro("UNKNOWN"));
+        } else {
+            EMITLN(2, "scan_str((char *)p+1, '%s');", i?"\"":"\\'");
+            EMITLN(2, "return %s;", str);
+        }
+    }
+    for (i = 0; lex_ops[i].c != 0; i++) {
+        EMITLN(1, "case '%c':", lex_ops[i].c);
+        if (lex_ops[i].c2 != 0) {
+            EMITLN(2, "if (p[1] == '%c') {", lex_ops[i].c2);
+            EMITLN(3, "++lex_curr;");
+            EMITLN(3, "return %s;", lex_macro(lex_ops[i].tok2));
+            EMITLN(2, "}");
+        }
+        EMITLN(2, "return %s;", lex_macro(lex_ops[i].tok));
+    }
+    fprintf(rec_file,
+    "    default:\n"
+    "        return %s;\n"
+    "    }\n"
+    "}\n",
+    lex_macro("UNKNOWN"));
+
+    /* names for error messages */
+    fprintf(rec_file,
+    "static const char *tok_print(int tok)\n"
+    "{\n"
+    "    static char buf[64];\n"
+    "\n"
+    "    switch (tok) {\n");
+    for (i = 0; i < SET_SIZE; i++) {
+        if (lexer_tokens & (1ULL<<i)) {
+            EMIT(1, "case %s: return \"", tok_macro(i));
+            write_cstr((char *)lex_num2print(i));
+            fprintf(rec_file, "\";\n");
+        }
+    }
+    /* T_OTHER: what lex.c would have called it */
+    fprintf(rec_file,
+    "    }\n"
+    "    switch (cclass[(unsigned char)*tok_begin]) {\n"
+    "    case C_ALPHA:\n"
+    "        return \"%s\";\n"
+    "    case C_DIGIT:\n"
+    "        return \"%s\";\n"
+    "    }\n"
+    "    switch (*tok_begin) {\n"
+    "    case '\\0':\n"
+    "        return \"%s\";\n"
+    "    case '\\'':\n"
+    "        return (tok_len > 0)?\"%s\":\"%s\";\n"
+    "    case '\"':\n"
+    "        return (tok_len > 0)?\"%s\":\"%s\";\n",
+    lex_num2print(lex_name2num("ID")), lex_num2print(lex_name2num("NUM")),
+    lex_num2print(lex_name2num("EOF")),
+    lex_num2print(lex_name2num("STR1")), lex_num2print(lex_name2num("UNKNOWN")),
+    lex_num2print(lex_name2num("STR2")), lex_num2print(lex_name2num("UNKNOWN")));
+    for (i = 0; lex_ops[i].c != 0; i++)
+        EMITLN(1, "case '%c':", lex_ops[i].c);
+    fprintf(rec_file,
+    "        snprintf(buf, sizeof(buf), \"%%.*s\", (int)(lex_curr-tok_begin), tok_begin);\n"
+    "        return buf;\n"
+    "    }\n"
+    "    return \"%s\";\n"
+    "}\n", lex_num2print(lex_name2num("UNKNOWN")));
+    fprintf(rec_file,
+    "/* counted from where it was last asked, as lex_lineno() does */\n"
+    "static int tok_lineno(void)\n"
+    "{\n"
+    "    static char *mark;\n"
+    "    static int line = 1; /* at mark */\n"
+    "    char *p;\n"
+    "\n"
+    "    if (mark == NULL)\n"
+    "        mark = lex_buf;\n"
+    "    if (lex_curr >= mark)\n"
+    "        for (p = mark; (p=memchr(p, '\\n', lex_curr-p)) != NULL; p++)\n"
+    "            ++line;\n"
+    "    else\n"
+    "        for (p = lex_curr; (p=memchr(p, '\\n', mark-p)) != NULL; p++)\n"
+    "            --line;\n"
+    "    mark = lex_curr;\n"
+    "    return line;\n"
+    "}\n");
+}
+
+/*
+    Named buffers live in per-invocation frames (see frame_push() in the
+    interpreter); a Buf keeps its memory when its slot is reused.
+*/
+static const char frames_code[] =
+"typedef struct FrameBlock FrameBlock;\n"
+"static struct FrameBlock {\n"
+"    FrameBlock *prev, *next;\n"
+"    int siz, top;\n"
+"    Buf *b;\n"
+"} frame0, *frame_blk = &frame0;\n"
+"typedef struct {\n"
+"    FrameBlock *blk;\n"
+"    int top;\n"
+"} FrameMark;\n"
+"static Buf *frame_push(int n, FrameMark *m)\n"
+"{\n"
+"    FrameBlock *b;\n"
+"    Buf *f;\n"
+"    int i;\n"
+"\n"
+"    m->blk = frame_blk;\n"
+"    m->top = frame_blk->top;\n"
+"    if (frame_blk->top+n > frame_blk->siz) {\n"
+"        if ((b=frame_blk->next)==NULL || b->siz<n) {\n"
+"            if ((b=calloc(1, sizeof(*b)))==NULL\n"
+"            || (b->b=calloc(b->siz=(n>1024)?n:1024, sizeof(Buf)))==NULL) {\n"
+"                fprintf(stderr, \"Out of memory\");\n"
+"                exit(EXIT_FAILURE);\n"
+"            }\n"
+"            b->prev = frame_blk;\n"
+"            if ((b->next=frame_blk->next) != NULL)\n"
+"                b->next->prev = b;\n"
+"            frame_blk->next = b;\n"
+"        }\n"
+"        b->top = 0;\n"
+"        frame_blk = b;\n"
+"    }\n"
+"    f = &frame_blk->b[frame_blk->top];\n"
+"    frame_blk->top += n;\n"
+"    for (i = 0; i < n; i++)\n"
+"        f[i].pos = 0;\n"
+"    return f;\n"
+"}\n"
+"static void frame_pop(FrameMark *m)\n"
+"{\n"
+"    frame_blk = m->blk;\n"
+"    frame_blk->top = m->top;\n"
+"}\n";
+
+/*
+    Error recovery in the generated recognizer (-g -e). Each rule call
+    records a RecFrame, where recover() jumps when the rule gives up.
+*/
+static const char *rec_frame_code(void)
+{
+    if (max_errors == 0)
+        return "";
+    return (nambuf_counter > 0)?
+    "typedef struct RecFrame {\n"
+    "    jmp_buf env;\n"
+    "    int rule;\n"
+    "    Buf *out;\n"
+    "    FrameMark fm;\n"
+    "    struct RecFrame *prev;\n"
+    "} RecFrame;\n"
+    "static RecFrame *rec_top;\n"
+    :
+    "typedef struct RecFrame {\n"
+    "    jmp_buf env;\n"
+    "    int rule;\n"
+    "    Buf *out;\n"
+    "    struct RecFrame *prev;\n"
+    "} RecFrame;\n"
+    "static RecFrame *rec_top;\n";
+}
+
+static void write_recovery(void)
+{
+    int i, eof;
+
+    eof = lex_name2num("EOF");
+    EMITLN(0, "#define MAX_ERRORS %d", max_errors);
+    EMITLN(0, "static int nerrors;");
+    EMITLN(0, "static long last_err_pos = -1;");
+    EMITLN(0, "/* per rule: the tokens that may follow it, the -y ones and EOF */");
+    EMITLN(0, "static const unsigned long long rec_sync[] = {");
+    for (i = 0; i < rule_counter; i++)
+        EMITLN(1, "0x%llxULL,", (unsigned long long)(follows[i] | sync_tokens | 1ULL<<eof));
+    EMITLN(0, "};");
+    if (spec_lexer)
+        fprintf(rec_file,
+        "static long tok_pos(void)\n"
+        "{\n"
+        "    return (long)(tok_begin-lex_buf);\n"
+        "}\n"
+        "static void skip_token(void)\n"
+        "{\n"
+        "    last_tok = tok_begin;\n"
+        "    last_len = tok_len;\n"
+        "    curr_tok = next_token();\n"
+        "}\n");
+    else
+        fprintf(rec_file,
+        "static long tok_pos(void)\n"
+        "{\n"
+        "    return lex_token_pos();\n"
+        "}\n"
+        "static void skip_token(void)\n"
+        "{\n"
+        "    last_pos = lex_token_pos();\n"
+        "    curr_tok = lex_get_token();\n"
+        "}\n");
+    fprintf(rec_file,
+    "static void rec_push(RecFrame *rf, int rule)\n"
+    "{\n"
+    "    rf->rule = rule;\n"
+    "    rf->out = out;\n"
+    "%s"
+    "    rf->prev = rec_top;\n"
+    "    rec_top = rf;\n"
+    "}\n"
+    "/* after curr_tok was found instead of expected: is expected there now? */\n"
+    "int recover(int expected)\n"
+    "{\n"
+    "    RecFrame *rf;\n"
+    "\n"
+    "    if (bt_top != NULL)\n"
+    "        backtrack();\n"
+    "    if (tok_pos() != last_err_pos) {\n"
+    "        out_flush();\n"
+    "        if (nerrors == MAX_ERRORS) {\n"
+    "            fprintf(stderr, \"%%s: too many errors, giving up\\n\", prog_name);\n"
+    "            exit(EXIT_FAILURE);\n"
+    "        }\n"
+    "        error_message();\n"
+    "        ++nerrors;\n"
+    "    } else if (curr_tok != %s) {\n"
+    "        skip_token();\n"
+    "    }\n"
+    "    while (curr_tok!=expected && !(rec_sync[rec_top->rule]>>curr_tok & 1))\n"
+    "        skip_token();\n"
+    "    last_err_pos = tok_pos();\n"
+    "    if (curr_tok == expected)\n"
+    "        return 1;\n"
+    "    rf = rec_top; /* the rule gives up */\n"
+    "    out = rf->out;\n"
+    "%s"
+    "    longjmp(rf->env, 1);\n"
+    "}\n",
+    (nambuf_counter > 0)?"    rf->fm.blk = frame_blk;\n    rf->fm.top = frame_blk->top;\n":"",
+    tok_macro(eof), (nambuf_counter > 0)?"    frame_pop(&rf->fm);\n":"");
+}
+
 static void generate_recognizer(void)
 {
     int i;
@@ -1275,72 +4627,622 @@ static void generate_recognizer(void)
     "#include <stdio.h>\n"
     "#include <stdlib.h>\n"
     "#include <string.h>\n"
-    "#include \"lex.h\"\n");
+    "#include <setjmp.h>\n"
+    "#include <unistd.h>\n"
+    "%s",
+    spec_lexer?"":"#include \"lex.h\"\n");
 
+    lexer_tokens = grammar_tokens;
+    if (spec_lexer || max_errors > 0) /* next_token(), recover() */
+        lexer_tokens |= 1ULL<<lex_name2num("EOF");
     for (i = 0; i < SET_SIZE; i++)
-        if (grammar_tokens & (1ULL<<i))
-            fprintf(rec_file, "#define T_%s %d\n", lex_num2name(i), i);
+        if (lexer_tokens & (1ULL<<i))
+            fprintf(rec_file, "#define %s %d\n", tok_macro(i), i);
+    for (i = 0; i < rule_counter; i++)
+        fprintf(rec_file, "#define R_%s %d\n", rule_names[i], i);
+
+    /*
+        Hooks for a program that embeds the recognizer (#including it, or
+        compiling it with -D): those it does not define are compiled out.
+        As in the interpreter, they also see what [[ ]] attempts match, and
+        the rules a failed attempt leaves exit with ok = 0; keeping track
+        of those costs a push per rule call, only if REC_EXIT is defined.
+    */
+    fprintf(rec_file,
+    "#ifndef REC_ENTER\n"
+    "#define REC_ENTER(rule)\n"
+    "#endif\n"
+    "#ifndef REC_EXIT\n"
+    "#define REC_EXIT(rule, ok)  /* ok is 0 when a failed [[ ]] attempt leaves it */\n"
+    "#else\n"
+    "#define REC_UNWIND\n"
+    "#endif\n"
+    "#ifndef REC_TOKEN\n"
+    "#define REC_TOKEN(tok, pos, len)    /* span of the token in the input */\n"
+    "#endif\n"
+    "#ifndef REC_CHECKPOINT\n"
+    "#define REC_CHECKPOINT()    /* a [[ ]] attempt begins */\n"
+    "#endif\n"
+    "#ifndef REC_BACKTRACK\n"
+    "#define REC_BACKTRACK()     /* it failed: what followed its checkpoint is taken back */\n"
+    "#endif\n"
+    "#ifndef REC_COMMIT\n"
+    "#define REC_COMMIT()        /* it succeeded */\n"
+    "#endif\n"
+    "#ifndef REC_MAIN\n"
+    "#define REC_MAIN main\n"
+    "#endif\n"
+    "#ifdef __GNUC__\n"
+    "#define MAYBE_UNUSED __attribute__((unused)) /* not every grammar calls it */\n"
+    "#else\n"
+    "#define MAYBE_UNUSED\n"
+    "#endif\n");
+
+    /*
+        The lexer interface used by the rest of the recognizer: LexMark
+        records the input position for [[ ]] and $push, match() consumes
+        a token, put_last() outputs the last matched one.
+    */
+    if (spec_lexer) {
+        write_lexer();
+        fprintf(rec_file,
+        "typedef struct {\n"
+        "    char *curr, *begin;\n"
+        "    int tok, len;\n"
+        "    const char *last;\n"
+        "    int last_len;\n"
+        "} LexMark;\n"
+        "static int curr_tok;\n"
+        "static const char *last_tok = \"\";\n"
+        "static int last_len;\n");
+    } else {
+        fprintf(rec_file,
+        "typedef struct {\n"
+        "    long pos, last; /* offsets of the current and the last matched tokens */\n"
+        "} LexMark;\n"
+        "static int curr_tok;\n"
+        "static long last_pos = -1;\n");
+    }
 
     fprintf(rec_file,
-    "static int curr_tok;\n"
+    "#define FLUSH_SIZE %d\n"
+    "typedef struct Checkpoint Checkpoint;\n"
+    "typedef struct {\n"
+    "    char *p;\n"
+    "    int pos, siz;\n"
+    "} Buf;\n"
+    "static void out_flush(void);\n"
     "static char *prog_name, *string_file;\n"
-    "static char last_tokstr[MAX_TOKSTR_LEN];\n"
     "static int gencnt = 1;\n"
     "static int indent = 0;\n"
-    "#define get_indent() (indent>0?indent:0)\n"
+    "static int atbeg = 1;\n"
+    "static int outputting = 1;\n"
+    "static Buf outbuf, *out = &outbuf;\n"
+    "static LexMark *save_stack;\n"
+    "static int savetop, save_size;\n"
+    "static struct {\n"
+    "    int slot;\n"
+    "    LexMark m;\n"
+    "} *undo_log; /* $pop'ed entries a checkpoint may need back */\n"
+    "static int undotop, undo_size, protect;\n"
+    "%s"
+    "%s"
+    "static struct Checkpoint {\n"
+    "    jmp_buf env;\n"
+    "    LexMark in;\n"
+    "    int gencnt, indent, atbeg, outputting, savetop, undotop, protect, outpos;\n"
+    "    Buf *out;\n"
+    "%s"
+    "%s"
+    "#ifdef REC_UNWIND\n"
+    "    int rule_top;\n"
+    "#endif\n"
+    "    Checkpoint *prev;\n"
+    "} *bt_top, *bt_first; /* innermost and outermost */\n"
     "#define LA(x) (curr_tok == (x))\n"
-    "static void error(void)\n"
+    "static void grow(Buf *b, int n)\n"
+    "{\n"
+    "    while (b->siz < b->pos+n)\n"
+    "        b->siz = b->siz*2+64;\n"
+    "    if ((b->p=realloc(b->p, b->siz)) == NULL) {\n"
+    "        fprintf(stderr, \"Out of memory\");\n"
+    "        exit(EXIT_FAILURE);\n"
+    "    }\n"
+    "}\n"
+    "#ifdef REC_UNWIND\n"
+    "static int *rule_stack, rule_top, rule_size; /* the rules being recognized */\n"
+    "static void rule_push(int rule)\n"
+    "{\n"
+    "    if (rule_top >= rule_size) {\n"
+    "        rule_size = rule_size*2+64;\n"
+    "        if ((rule_stack=realloc(rule_stack, rule_size*sizeof(*rule_stack))) == NULL) {\n"
+    "            fprintf(stderr, \"Out of memory\");\n"
+    "            exit(EXIT_FAILURE);\n"
+    "        }\n"
+    "    }\n"
+    "    rule_stack[rule_top++] = rule;\n"
+    "}\n"
+    "#define RULE_PUSH(rule)     rule_push(rule)\n"
+    "#define RULE_POP()          (--rule_top)\n"
+    "#else\n"
+    "#define RULE_PUSH(rule)\n"
+    "#define RULE_POP()\n"
+    "#endif\n"
+    "static inline void put_mem(const char *s, int n)\n"
+    "{\n"
+    "    if (out->pos+n > out->siz)\n"
+    "        grow(out, n);\n"
+    "    memcpy(out->p+out->pos, s, n);\n"
+    "    out->pos += n;\n"
+    "}\n",
+    FLUSH_SIZE, (nambuf_counter > 0)?frames_code:"", rec_frame_code(),
+    (nambuf_counter > 0)?"    FrameMark fm;\n":"", (max_errors > 0)?"    struct RecFrame *rf;\n":"");
+
+    if (spec_lexer)
+        fprintf(rec_file,
+        "static void lex_save(LexMark *m)\n"
+        "{\n"
+        "    m->curr = lex_curr;\n"
+        "    m->begin = tok_begin;\n"
+        "    m->len = tok_len;\n"
+        "    m->tok = curr_tok;\n"
+        "    m->last = last_tok;\n"
+        "    m->last_len = last_len;\n"
+        "}\n"
+        "static void lex_restore(LexMark *m)\n"
+        "{\n"
+        "    lex_curr = m->curr;\n"
+        "    tok_begin = m->begin;\n"
+        "    tok_len = m->len;\n"
+        "    curr_tok = m->tok;\n"
+        "    last_tok = m->last;\n"
+        "    last_len = m->last_len;\n"
+        "}\n"
+        "static char *read_input(const char *path)\n"
+        "{\n"
+        "    FILE *fp;\n"
+        "    char *buf;\n"
+        "    size_t len, siz, n;\n"
+        "\n"
+        "    if (strcmp(path, \"-\") == 0)\n"
+        "        fp = stdin;\n"
+        "    else if ((fp=fopen(path, \"rb\")) == NULL)\n"
+        "        return NULL;\n"
+        "    len = 0;\n"
+        "    buf = malloc(siz=65536);\n"
+        "    while ((n=fread(buf+len, 1, siz-len-1, fp)) > 0)\n"
+        "        if ((len+=n) == siz-1)\n"
+        "            buf = realloc(buf, siz*=2);\n"
+        "    buf[len] = '\\0';\n"
+        "    if (fp != stdin)\n"
+        "        fclose(fp);\n"
+        "    return buf;\n"
+        "}\n"
+        "static void match(int expected)\n"
+        "{\n"
+        "    void error(void);\n"
+        "%s"
+        "\n"
+        "    if (curr_tok == expected%s) {\n"
+        "        REC_TOKEN(expected, tok_begin-lex_buf, lex_curr-tok_begin);\n"
+        "        last_tok = tok_begin;\n"
+        "        last_len = tok_len;\n"
+        "        curr_tok = next_token();\n"
+        "    } else {\n"
+        "        error();\n"
+        "    }\n"
+        "}\n"
+        "static MAYBE_UNUSED void put_last(void)\n"
+        "{\n"
+        "    const char *p;\n"
+        "\n"
+        "    if (last_len>0 && (last_tok[0]=='\\'' || last_tok[0]=='\"')) {\n"
+        "        /* strip the backslash of escaped quotes, as lex.c does */\n"
+        "        for (p = last_tok; p < last_tok+last_len; p++)\n"
+        "            if (p[0]!='\\\\' || p[1]!=last_tok[0] || p+1==last_tok+last_len-1)\n"
+        "                put_mem(p, 1);\n"
+        "        return;\n"
+        "    }\n"
+        "    put_mem(last_tok, last_len);\n"
+        "}\n"
+        "static void error_message(void)\n"
+        "{\n"
+        "    fprintf(stderr, \"%%s: %%s:%%d: error: unexpected `%%s'\\n\", prog_name,\n"
+        "    string_file, tok_lineno(), tok_print(curr_tok));\n"
+        "}\n", (max_errors > 0)?"    int recover(int expected);\n":"", (max_errors > 0)?" || recover(expected)":"");
+    else
+        fprintf(rec_file,
+        "static void lex_save(LexMark *m)\n"
+        "{\n"
+        "    m->pos = lex_token_pos();\n"
+        "    m->last = last_pos;\n"
+        "}\n"
+        "static void lex_restore(LexMark *m)\n"
+        "{\n"
+        "    curr_tok = lex_reset(m->last, m->pos);\n"
+        "    last_pos = m->last;\n"
+        "}\n"
+        "static long mark_pin(LexMark *m)\n"
+        "{\n"
+        "    return (m->last != -1)?m->last:m->pos;\n"
+        "}\n"
+        "/* the lexer's pin hook */\n"
+        "static long lowest_input(void)\n"
+        "{\n"
+        "    long pin, p;\n"
+        "    int i;\n"
+        "\n"
+        "    pin = last_pos; /* a $push saves it */\n"
+        "    if (bt_top!=NULL && (pin==-1 || (p=mark_pin(&bt_first->in))<pin))\n"
+        "        pin = p;\n"
+        "    if (savetop>0 && (pin==-1 || (p=mark_pin(&save_stack[0]))<pin))\n"
+        "        pin = p;\n"
+        "    for (i = 0; i < undotop; i++)\n"
+        "        if (pin==-1 || (p=mark_pin(&undo_log[i].m))<pin)\n"
+        "            pin = p;\n"
+        "    return pin;\n"
+        "}\n"
+        "static void match(int expected)\n"
+        "{\n"
+        "    void error(void);\n"
+        "%s"
+        "\n"
+        "    if (curr_tok == expected%s) {\n"
+        "        last_pos = lex_token_pos();\n"
+        "        REC_TOKEN(expected, last_pos, lex_offset()-last_pos);\n"
+        "        curr_tok = lex_get_token();\n"
+        "    } else {\n"
+        "        error();\n"
+        "    }\n"
+        "}\n"
+        "static MAYBE_UNUSED void put_last(void)\n"
+        "{\n"
+        "    const char *s;\n"
+        "\n"
+        "    s = lex_last_string();\n"
+        "    put_mem(s, (int)strlen(s));\n"
+        "}\n"
+        "static void error_message(void)\n"
+        "{\n"
+        "    fprintf(stderr, \"%%s: %%s:%%d: error: unexpected `%%s'\\n\", prog_name,\n"
+        "    string_file, lex_lineno(), lex_num2print(curr_tok));\n"
+        "}\n", (max_errors > 0)?"    int recover(int expected);\n":"", (max_errors > 0)?" || recover(expected)":"");
+
+    fprintf(rec_file,
+    "static MAYBE_UNUSED void checkpoint(Checkpoint *cp)\n"
+    "{\n"
+    "    lex_save(&cp->in);\n"
+    "    cp->gencnt = gencnt;\n"
+    "    cp->indent = indent;\n"
+    "    cp->atbeg = atbeg;\n"
+    "    cp->outputting = outputting;\n"
+    "    cp->savetop = savetop;\n"
+    "    cp->undotop = undotop;\n"
+    "    cp->protect = protect;\n"
+    "    if (savetop > protect)\n"
+    "        protect = savetop;\n"
+    "    cp->out = out;\n"
+    "    cp->outpos = out->pos;\n"
+    "%s"
+    "%s"
+    "#ifdef REC_UNWIND\n"
+    "    cp->rule_top = rule_top;\n"
+    "#endif\n"
+    "    if ((cp->prev=bt_top) == NULL)\n"
+    "        bt_first = cp;\n"
+    "    bt_top = cp;\n"
+    "    REC_CHECKPOINT();\n"
+    "}\n"
+    "static inline void flush(void);\n"
+    "static MAYBE_UNUSED void commit(Checkpoint *cp)\n"
+    "{\n"
+    "    REC_COMMIT();\n"
+    "    bt_top = cp->prev;\n"
+    "    protect = cp->protect;\n"
+    "    if (bt_top == NULL) {\n"
+    "        undotop = 0;\n"
+    "        flush();\n"
+    "    }\n"
+    "}\n"
+    "static void backtrack(void)\n"
+    "{\n"
+    "    Checkpoint *cp;\n"
+    "\n"
+    "    cp = bt_top;\n"
+    "#ifdef REC_UNWIND\n"
+    "    while (rule_top > cp->rule_top) {\n"
+    "        --rule_top;\n"
+    "        REC_EXIT(rule_stack[rule_top], 0);\n"
+    "    }\n"
+    "#endif\n"
+    "    REC_BACKTRACK();\n"
+    "    bt_top = cp->prev;\n"
+    "    for (; undotop > cp->undotop; undotop--)\n"
+    "        save_stack[undo_log[undotop-1].slot] = undo_log[undotop-1].m;\n"
+    "    savetop = cp->savetop;\n"
+    "    protect = cp->protect;\n"
+    "    lex_restore(&cp->in);\n"
+    "    gencnt = cp->gencnt;\n"
+    "    indent = cp->indent;\n"
+    "    atbeg = cp->atbeg;\n"
+    "    outputting = cp->outputting;\n"
+    "%s"
+    "%s"
+    "    out = cp->out;\n"
+    "    out->pos = cp->outpos;\n"
+    "    longjmp(cp->env, 1);\n"
+    "}\n"
+    "static void die(const char *msg)\n"
+    "{\n"
+    "    if (bt_top == NULL)\n"
+    "        out_flush();\n"
+    "    fprintf(stderr, \"%%s: %%s\\n\", prog_name, msg);\n"
+    "    exit(EXIT_FAILURE);\n"
+    "}\n"
+    "void error(void)\n"
     "{\n"
-    "    fprintf(stderr, \"%%s: %%s:%%d: error: unexpected `%%s'\\n\", prog_name,\n"
-    "    string_file, lex_lineno(), lex_num2print(curr_tok));\n"
+    "    if (bt_top != NULL)\n"
+    "        backtrack();\n"
+    "    out_flush();\n"
+    "    error_message();\n"
     "    exit(EXIT_FAILURE);\n"
     "}\n"
-    "static int gennum(int *gen)\n"
+    "static MAYBE_UNUSED int gennum(volatile int *gen)\n"
     "{\n"
     "    if (*gen == -1)\n"
     "        *gen = gencnt++;\n"
     "    return *gen;\n"
     "}\n"
-    "static void match(int expected)\n"
+    "static MAYBE_UNUSED void push_input(void)\n"
+    "{\n"
+    "    if (savetop >= save_size) {\n"
+    "        save_size = save_size*2+16;\n"
+    "        if ((save_stack=realloc(save_stack, save_size*sizeof(*save_stack))) == NULL)\n"
+    "            die(\"Out of memory\");\n"
+    "    }\n"
+    "    lex_save(&save_stack[savetop++]);\n"
+    "}\n"
+    "static MAYBE_UNUSED void pop_input(void)\n"
+    "{\n"
+    "    if (savetop <= 0)\n"
+    "        die(\"$pop: stack underflow!\");\n"
+    "    if (--savetop < protect) {\n"
+    "        if (undotop >= undo_size) {\n"
+    "            undo_size = undo_size*2+16;\n"
+    "            if ((undo_log=realloc(undo_log, undo_size*sizeof(*undo_log))) == NULL)\n"
+    "                die(\"Out of memory\");\n"
+    "        }\n"
+    "        undo_log[undotop].slot = savetop;\n"
+    "        undo_log[undotop++].m = save_stack[savetop];\n"
+    "    }\n"
+    "    lex_restore(&save_stack[savetop]);\n"
+    "}\n"
+    "static void put_spaces(void)\n"
+    "{\n"
+    "    static const char spaces[] = \"%64s\";\n"
+    "    int n;\n"
+    "\n"
+    "    for (n = indent; n > 0; n -= 64)\n"
+    "        put_mem(spaces, (n<64)?n:64);\n"
+    "}\n"
+    "static inline void put_indent(void)\n"
+    "{\n"
+    "    if (atbeg)\n"
+    "        put_spaces();\n"
+    "}\n"
+    "static MAYBE_UNUSED void put_num(int n)\n"
+    "{\n"
+    "    char buf[16], *p;\n"
+    "    unsigned u;\n"
+    "\n"
+    "    p = buf+sizeof(buf);\n"
+    "    u = (n<0)?-(unsigned)n:(unsigned)n;\n"
+    "    do\n"
+    "        *--p = (char)('0'+u%%10);\n"
+    "    while ((u/=10) != 0);\n"
+    "    if (n < 0)\n"
+    "        *--p = '-';\n"
+    "    put_mem(p, (int)(buf+sizeof(buf)-p));\n"
+    "}\n"
+    "static MAYBE_UNUSED void put_buf(Buf *buf)\n"
+    "{\n"
+    "    put_mem(buf->p, buf->pos);\n"
+    "    atbeg = (buf->pos>0 && buf->p[buf->pos-1]=='\\n');\n"
+    "}\n"
+    "static void out_flush(void)\n"
+    "{\n"
+    "    int n, w;\n"
+    "\n"
+    "    for (n = 0; n < outbuf.pos; n += w)\n"
+    "        if ((w=(int)write(1, outbuf.p+n, outbuf.pos-n)) <= 0)\n"
+    "            break;\n"
+    "    outbuf.pos = 0;\n"
+    "}\n"
+    "/* write the output that no checkpoint can take back */\n"
+    "static void out_commit(void)\n"
     "{\n"
-    "    if (curr_tok == expected) {\n"
-    "        strcpy(last_tokstr, lex_token_string());\n"
-    "        curr_tok = lex_get_token();\n"
-    "    } else {\n"
-    "        error();\n"
+    "    Checkpoint *cp;\n"
+    "    int n, w, k;\n"
+    "\n"
+    "    if (bt_top == NULL) {\n"
+    "        out_flush();\n"
+    "        return;\n"
     "    }\n"
+    "    n = (bt_first->out == &outbuf)?bt_first->outpos:outbuf.pos;\n"
+    "    if (n < FLUSH_SIZE)\n"
+    "        return;\n"
+    "    for (k = 0; k < n; k += w)\n"
+    "        if ((w=(int)write(1, outbuf.p+k, n-k)) <= 0)\n"
+    "            break;\n"
+    "    memmove(outbuf.p, outbuf.p+n, outbuf.pos-n);\n"
+    "    outbuf.pos -= n;\n"
+    "    for (cp = bt_top; cp != NULL; cp = cp->prev)\n"
+    "        if (cp->out == &outbuf)\n"
+    "            cp->outpos -= n;\n"
     "}\n"
-    );
+    "static inline void flush(void)\n"
+    "{\n"
+    "    if (out==&outbuf && outbuf.pos>=FLUSH_SIZE)\n"
+    "        out_commit();\n"
+    "}\n", (nambuf_counter > 0)?"    cp->fm.blk = frame_blk;\n    cp->fm.top = frame_blk->top;\n":"",
+    (max_errors > 0)?"    cp->rf = rec_top;\n":"",
+    (nambuf_counter > 0)?"    frame_pop(&cp->fm);\n":"",
+    (max_errors > 0)?"    rec_top = cp->rf;\n":"", "");
 
+    if (max_errors > 0)
+        write_recovery();
+
+    write_la_tests();
     for (i = 0; i < rule_counter; i++)
         EMITLN(0, "static void rule_%s(void);", rule_names[i]);
 
     for (i = 0; i < rule_counter; i++) {
         EMITLN(0, "void rule_%s(void) {", rule_names[i]);
         if (gen_usage[i])
-            EMITLN(1, "int _gen = -1;");
-        write_rule(rules[i], FALSE, FALSE, 1);
+            EMITLN(1, "volatile int _gen = -1;");
+        if (rule_nbufs[i] > 0) {
+            EMITLN(1, "FrameMark _fm;");
+            EMITLN(1, "Buf *nb = frame_push(%d, &_fm);", rule_nbufs[i]);
+        }
+        if (max_errors > 0)
+            EMITLN(1, "RecFrame _rf;");
+        EMITLN(1, "REC_ENTER(R_%s);", rule_names[i]);
+        EMITLN(1, "RULE_PUSH(R_%s);", rule_names[i]);
+        if (max_errors > 0) {
+            EMITLN(1, "rec_push(&_rf, R_%s);", rule_names[i]);
+            EMITLN(1, "if (setjmp(_rf.env) == 0) {");
+            write_rule(rules[i], FALSE, FALSE, 2);
+            EMIT(0, "\n    }\n    rec_top = _rf.prev;");
+        } else {
+            write_rule(rules[i], FALSE, FALSE, 1);
+        }
+        EMIT(0, "\n    RULE_POP();\n    REC_EXIT(R_%s, 1);", rule_names[i]);
+        if (rule_nbufs[i] > 0)
+            EMIT(0, "\n    frame_pop(&_fm);");
         EMITLN(0, "\n}");
     }
 
     fprintf(rec_file,
-    "int main(int argc, char *argv[])\n"
+    "int REC_MAIN(int argc, char *argv[])\n"
     "{\n"
     "    prog_name = argv[0];\n"
-    "    string_file = argv[1];\n"
-    "    lex_init(string_file);\n");
+    "    string_file = argv[1];\n");
 
-    for (kw = lex_keyword_iterate(TRUE); kw != NULL; kw = lex_keyword_iterate(FALSE))
-        fprintf(rec_file, "    lex_keyword(\"%s\");\n", kw);
+    if (spec_lexer) {
+        fprintf(rec_file,
+        "    if ((lex_buf=read_input(string_file)) == NULL) {\n"
+        "        fprintf(stderr, \"%%s: cannot read file `%%s'\\n\", prog_name, string_file);\n"
+        "        exit(EXIT_FAILURE);\n"
+        "    }\n"
+        "    lex_curr = lex_buf;\n");
+    } else {
+        fprintf(rec_file,
+        "    lex_init(string_file);\n"
+        "    lex_set_pin_hook(lowest_input);\n");
+        for (kw = lex_keyword_iterate(TRUE); kw != NULL; kw = lex_keyword_iterate(FALSE))
+            fprintf(rec_file, "    lex_keyword(\"%s\");\n", kw);
+    }
 
     fprintf(rec_file,
-    "    curr_tok = lex_get_token();\n"
+    "    curr_tok = %s;\n"
     "    rule_%s();\n"
-    "    lex_finish();\n"
-    "    return 0;\n"
+    "    out_flush();\n"
+    "    %s;\n"
+    "    return %s;\n"
     "}\n",
-    rule_names[start_symbol]);
+    spec_lexer?"next_token()":"lex_get_token()",
+    rule_names[start_symbol],
+    spec_lexer?"free(lex_buf)":"lex_finish()",
+    (max_errors > 0)?"nerrors > 0":"0");
+}
+/* ============================================================ */
+/* Several grammars over one input (-m)                         */
+/* ============================================================ */
+
+/*
+    -m<file> recognizes <file> with each of the grammars given. The input
+    is scanned once, knowing the keywords of all of them, and then a
+    process is forked for each grammar (the interpreter keeps its state
+    in globals). They run at the same time and read the tokens from
+    memory, where a keyword their grammar does not use is an ID. The
+    output of each (stderr too) goes to a temporary file, copied to
+    stdout after a line that says whether the grammar accepts the input.
+*/
+static char *multi_input;
+
+/* define the keywords of the grammar in path (strings of output actions are not) */
+static void scan_keywords(char *path)
+{
+    int tok, in_out;
+
+    if ((grammar_buf=read_file(path)) == NULL)
+        DIE("cannot read file `%s'", path);
+    grammar_file_path = path;
+    curr_ch = grammar_buf;
+    grammar_eof = FALSE;
+    in_out = FALSE;
+    while ((tok=get_token()) != -1) {
+        if (tok == TOK_LBRACE2)
+            in_out = TRUE;
+        else if (tok == TOK_RBRACE2)
+            in_out = FALSE;
+        else if (tok==TOK_STR && !in_out)
+            lex_str2num(token_string);
+    }
+    free(grammar_buf);
+    grammar_eof = FALSE;
+}
+
+/* returns in each child, set to recognize with its grammar; the parent exits */
+static void fork_grammars(char **paths, int n)
+{
+    FILE **out;
+    pid_t *pid;
+    const char *kw;
+    char buf[65536];
+    size_t len;
+    int i, status, ok, fail, last;
+
+    for (i = 0; i < n; i++)
+        scan_keywords(paths[i]);
+    for (kw = lex_keyword_iterate(TRUE); kw != NULL; kw = lex_keyword_iterate(FALSE))
+        if (lex_str2num(kw) >= SET_SIZE)
+            DIE("the grammars use too many keywords between them");
+    if (lex_tokenize(multi_input) == -1)
+        DIE("cannot read file `%s'", multi_input);
+    out = malloc(n*sizeof(*out));
+    pid = malloc(n*sizeof(*pid));
+    fflush(stdout);
+    fflush(stderr);
+    for (i = 0; i < n; i++) {
+        if ((out[i]=tmpfile()) == NULL)
+            DIE("cannot create a temporary file");
+        if ((pid[i]=fork()) == -1)
+            DIE("fork() failed");
+        if (pid[i] == 0) {
+            dup2(fileno(out[i]), 1);
+            dup2(fileno(out[i]), 2);
+            lex_unuse_keywords();
+            grammar_file_path = paths[i];
+            string_file_path = multi_input;
+            return;
+        }
+    }
+    for (i = fail = 0; i < n; i++) {
+        waitpid(pid[i], &status, 0);
+        ok = WIFEXITED(status) && WEXITSTATUS(status)==0;
+        printf("==> %s [%s]\n", paths[i], ok?"PASS":"FAIL");
+        rewind(out[i]);
+        for (last = '\n'; (len=fread(buf, 1, sizeof(buf), out[i])) > 0; last = buf[len-1])
+            fwrite(buf, 1, len, stdout);
+        if (last != '\n')
+            putchar('\n');
+        fclose(out[i]);
+        fail += !ok;
+    }
+    exit(fail?EXIT_FAILURE:EXIT_SUCCESS);
 }
+
 /* ============================================================ */
 
 static void print_first_sets(void)
@@ -1367,6 +5269,7 @@ static void print_follow_sets(void)
 static void usage(int ext)
 {
     fprintf(stderr, "usage: %s [ options ] <grammar_file> [ <string_file> ]\n", prog_name);
+    fprintf(stderr, "       %s [ options ] -m<string_file> <grammar_file> ...\n", prog_name);
     if (ext)
         exit(EXIT_SUCCESS);
 }
@@ -1374,16 +5277,20 @@ static void usage(int ext)
 int main(int argc, char *argv[])
 {
     int i;
-    int print_first, print_follow, validate, generate;
-    char *outfile;
+    int print_first, print_follow, validate, generate, tokenize;
+    char *outfile, **paths;
+    int npaths;
 
     prog_name = argv[0];
     outfile = NULL;
-    validate = print_first = print_follow = generate = FALSE;
+    validate = print_first = print_follow = generate = tokenize = FALSE;
     if (argc == 1)
         usage(TRUE);
+    paths = malloc(argc*sizeof(*paths));
+    npaths = 0;
     for (i = 1; i < argc; i++) {
-        if (argv[i][0] != '-') {
+        if (argv[i][0]!='-' || argv[i][1]=='\0') { /* "-" is stdin */
+            paths[npaths++] = argv[i];
             if (grammar_file_path == NULL)
                 grammar_file_path = argv[i];
             else
@@ -1411,8 +5318,99 @@ int main(int argc, char *argv[])
         case 'g':
             generate = TRUE;
             break;
+        case 's':
+            spec_lexer = TRUE;
+            break;
+        case 'b':
+            bt_report = bt_stats = TRUE;
+            break;
+        case 'T': {
+            char *comma;
+
+            if (argv[i][2] == '\0')
+                DIE("missing file for -T option");
+            trace_path = argv[i]+2;
+            if ((comma=strrchr(trace_path, ',')) != NULL) {
+                *comma = '\0';
+                if ((trace_records=strtoul(comma+1, NULL, 10)) == 0)
+                    DIE("invalid number of records for -T option");
+            }
+        }
+            break;
+        case 'e':
+            max_errors = MAX_ERRORS;
+            if (argv[i][2]!='\0' && (max_errors=atoi(argv[i]+2))<1)
+                DIE("invalid number of errors for -e option");
+            break;
+        case 'L':
+            if (argv[i][2] == '\0')
+                DIE("missing budgets for -L option");
+            parse_budgets(argv[i]+2);
+            break;
+        case 'y':
+            if (argv[i][2] == '\0')
+                DIE("missing token for -y option");
+            sync_names = realloc(sync_names, (nsync_names+1)*sizeof(*sync_names));
+            sync_names[nsync_names++] = argv[i]+2;
+            break;
+        case 'E':
+            if (argv[i][2] == '\0')
+                DIE("missing file for -E option");
+            event_path = argv[i]+2;
+            break;
+        case 'p':
+            profiling = bt_stats = TRUE;
+            if (argv[i][2] != '\0')
+                profile_path = argv[i]+2;
+            break;
+        case 'r': {
+            char *end;
+
+            random_size = strtol(argv[i]+2, &end, 10);
+            switch (*end) {
+            case 'k': case 'K': random_size <<= 10; break;
+            case 'm': case 'M': random_size <<= 20; break;
+            case 'g': case 'G': random_size <<= 30; break;
+            }
+            if (random_size <= 0)
+                DIE("invalid size for -r option");
+        }
+            break;
+        case 't':
+            tokenize = TRUE;
+            break;
+        case 'S':
+            random_seed = strtoull(argv[i]+2, NULL, 0);
+            if (random_seed == 0)
+                DIE("the seed for -S must be nonzero");
+            break;
+        case 'a':
+            adaptive = TRUE;
+            if (argv[i][2] != '\0')
+                dfa_path = argv[i]+2;
+            break;
+        case 'm':
+            if (argv[i][2] == '\0')
+                DIE("missing file for -m option");
+            multi_input = argv[i]+2;
+            break;
+        case 'P':
+            if (argv[i][2] == '\0')
+                DIE("missing file for -P option");
+            branch_prof_path = argv[i]+2;
+            break;
+        case 'U':
+            if (argv[i][2] == '\0')
+                DIE("missing file for -U option");
+            branch_use_path = argv[i]+2;
+            break;
+        case 'k':
+            if ((lookahead=atoi(argv[i]+2))<1 || lookahead>MAX_LOOKAHEAD)
+                DIE("-k expects a number of tokens between 1 and %d", MAX_LOOKAHEAD);
+            break;
         case 'v':
             verbose = TRUE;
+            flush_size = 0; /* keep the output in step with the trace */
             break;
         case 'h':
             usage(FALSE);
@@ -1422,15 +5420,40 @@ int main(int argc, char *argv[])
                    "  -l: print follow sets\n"
                    "  -c: check the grammar for LL(1) conflicts\n"
                    "  -g: generate a recognizer in C\n"
+                   "  -s: emit a lexer specialized to the grammar (with -g)\n"
+                   "  -p[<file>]: print a profile of the rules to stderr (and as JSON to <file>)\n"
+                   "  -b: print what backtracking ([[ ]]) costs to stderr\n"
+                   "  -k<n>: decide [[ ]] by up to <n> tokens of lookahead where that is exact (-c lists them)\n"
+                   "  -m<file>: recognize <file> with each of the grammars given, scanning it once\n"
+                   "  -P<file>: count the alternatives | takes and add the counts to <file>\n"
+                   "  -U<file>: test the alternatives of | in the order of the counts in <file>\n"
+                   "  -a[<file>]: predict | with First/First conflicts from the input (and keep the DFAs in <file>)\n"
+                   "  -r<size>: write a random sentence of about <size> bytes (suffixes K, M, G)\n"
+                   "  -S<seed>: seed for -r (default 1)\n"
+                   "  -t: only tokenize the input string and print the number of tokens\n"
                    "  -v: verbose mode\n"
-                   "  -h: print this help\n");
+                   "  -T<file>[,<n>]: trace into a ring of <n> binary records mapped from <file>\n"
+                   "  -E<file>: write the derivation to <file> as a binary stream of events\n"
+                   "  -e[<max>]: report up to <max> errors (default %d), skipping tokens after each\n"
+                   "  -y<token>: also skip up to <token> after an error (e.g. -y';')\n"
+                   "  -L<name>=<n>,...: stop with status 3 past <n> steps, rollbacks, depth or time (ms)\n"
+                   "  -h: print this help\n", MAX_ERRORS);
             exit(EXIT_SUCCESS);
         default:
             DIE("unknown option `%s'", argv[i]);
         }
     }
+    if (multi_input != NULL) {
+        if (npaths==0 || generate || random_size || tokenize)
+            DIE("-m takes one or more grammars, and no -g, -r or -t");
+        /* the grammars would all write the same file */
+        if (event_path!=NULL || trace_path!=NULL || branch_prof_path!=NULL
+        || dfa_path!=NULL || profile_path!=NULL)
+            DIE("-m cannot be used with -E, -T, -P, -a<file> or -p<file>");
+        fork_grammars(paths, npaths);
+    }
     if (grammar_file_path==NULL
-    || (string_file_path==NULL && !print_first && !print_follow && !validate && !generate))
+    || (string_file_path==NULL && !print_first && !print_follow && !validate && !generate && !random_size))
         usage(TRUE);
 
     if ((grammar_buf=read_file(grammar_file_path)) == NULL)
@@ -1438,64 +5461,123 @@ int main(int argc, char *argv[])
     curr_ch = grammar_buf;
     LA = get_token();
     grammar();
+    if (adaptive || branch_prof_path!=NULL || branch_use_path!=NULL)
+        grammar_hash = hash(grammar_buf);
     free(grammar_buf);
     if (start_symbol == -1)
         err(1, GRA_ERR, "start symbol not defined");
     if (nundef != 0) {
-        char buf[256];
+        StrBuf *names;
+        int n;
 
-        buf[0] = '\0';
-        for (i = 0; i < rule_counter; i++) {
-            if (rules[i] == NULL) {
-                if (buf[0] != '\0')
-                    strcat(buf, ", ");
-                strcat(buf, "`");
-                strcat(buf, rule_names[i]);
-                strcat(buf, "'");
-            }
-        }
-        err(1, GRA_ERR, "the grammar contains the following undefined symbols: %s", buf);
+        names = strbuf_new(256);
+        for (i = n = 0; i < rule_counter; i++)
+            if (rules[i] == NULL)
+                strbuf_printf(names, "%s`%s'", (n++ > 0)?", ":"", rule_names[i]);
+        err(1, GRA_ERR, "the grammar contains the following undefined symbols: %s", strbuf_str(names));
     }
-    if (validate) {
-        if (rule_counter <= 64)
-            conflicts();
-        else
-            err(1, GRA_ERR, "cannot validate the grammar (more than 64 rules)");
+    if (lookahead > 0) {
+        decide_sites();
+        if (validate)
+            print_la_report();
     }
+    if (branch_prof_path!=NULL || branch_use_path!=NULL)
+        init_chains();
+    if (adaptive) {
+        init_adaptive();
+        if (validate)
+            print_adaptive_report();
+    }
+    if (max_errors > 0) {
+        compute_follow_sets();
+        for (i = 0; i < nsync_names; i++)
+            sync_tokens |= 1ULL<<sync_token(sync_names[i]);
+    }
+    if (validate)
+        conflicts();
     if (print_first)
         print_first_sets();
     if (print_follow)
         print_follow_sets();
+    if (random_size > 0)
+        random_sentence();
     if (generate) {
         rec_file = (outfile!=NULL)?fopen(outfile, "wb"):stdout;
         generate_recognizer();
         if (outfile != NULL)
             fclose(rec_file);
     }
-    if (string_file_path != NULL) {
+    if (string_file_path!=NULL && tokenize) {
+        unsigned long ntok;
+        int eof;
+
+        if (lex_init(string_file_path) == -1)
+            DIE("lex_init() failed!");
+        eof = lex_name2num("EOF");
+        for (ntok = 0; lex_get_token() != eof; ntok++)
+            ;
+        printf("%lu\n", ntok);
+        lex_finish();
+    } else if (string_file_path != NULL) {
         int gen;
+        FrameMark fm;
 
         gen = -1;
-        if (lex_init(string_file_path) == -1)
+        budget_start();
+        if (multi_input==NULL && lex_init(string_file_path)==-1)
             DIE("lex_init() failed!");
 
         outbuf = strbuf_new(256);
+        lex_set_read_hook(flush_output);
+        lex_set_pin_hook(lowest_input);
         curr_tok = lex_get_token();
+        state.input.last_pos = -1;
         state.atbeg = TRUE;
         state.outputting = TRUE;
         state.gencnt = 1;
+        curr_rule = start_symbol;
 
         if (verbose) {
-            printf(">> replacing `%s' (%s:%d)\n", rule_names[start_symbol], string_file_path, lex_lineno());
-            ++state.verind;
+            Hooks h = { verbose_enter, NULL, verbose_token };
+
+            add_hooks(&h);
         }
-        recognize(rules[start_symbol], &gen, FALSE, outbuf);
+        if (trace_path != NULL) {
+            Hooks h = { trace_enter, trace_exit, trace_token };
+
+            trace_open();
+            add_hooks(&h);
+        }
+        if (event_path != NULL) {
+            Hooks h = { ev_enter, ev_exit, ev_token };
+
+            ev_open();
+            add_hooks(&h);
+        }
+        if (nhooks > 0)
+            CALL_HOOKS(enter, start_symbol);
+        ++state.verind;
+        if (bt_report)
+            atexit(write_bt_report);
+        frame_push(rule_nbufs[start_symbol], &fm);
+        if (profiling) {
+            atexit(write_profile);
+            prof_start();
+            prof_enter(start_symbol);
+            recognize(rules[start_symbol], &gen, FALSE, NULL);
+            prof_exit();
+        } else {
+            recognize(rules[start_symbol], &gen, FALSE, NULL);
+        }
+        --state.verind;
+        if (nhooks > 0)
+            CALL_HOOKS(exit, start_symbol, TRUE);
         strbuf_flush(outbuf);
         strbuf_destroy(outbuf);
-        for (i = 0; i < nambuf_counter; i++)
-            strbuf_destroy(named_buffers[i].buf);
         if (lex_finish() == -1)
             ;
+        if (nerrors > 0)
+            exit(EXIT_FAILURE);
     }
     return 0;
 }
@@ -4,45 +4,180 @@
 #include <string.h>
 #include <ctype.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "util.h"
 
 typedef struct Keyword Keyword;
-typedef struct LexState LexState;
 
-static int lineno = 1;
-static char *buf, *curr;
-static char token_string[MAX_TOKSTR_LEN];
+/*
+    The input is read in chunks into a window, buf[0..end-buf) holding the
+    bytes from offset base on (followed by a NUL). Bytes before the
+    current position are dropped when the window is refilled, unless the
+    pin hook says that lex_reset() may still go back to them (because of a
+    [[ ]] checkpoint or a $push). Such a position is just the offset of a
+    token: going back scans that token again.
+
+    Line numbers are only needed for messages, so they are not tracked by
+    the scanner: lex_lineno() counts the new-lines between the position it
+    was last asked about and the current one (backwards after a rollback).
+    fill() moves that mark forward over the bytes it drops.
+*/
+#define LEX_CHUNK   65536
+
+static long nl_pos;     /* nl_count new-lines before offset nl_pos */
+static long nl_count;
+static char *buf, *curr, *end;
+static long base, tok_pos;
+static size_t buf_siz;
+static int in_fd = -1, in_eof;
+static void (*read_hook)(void);
+static long (*pin_hook)(void);
+static long peek_pin = -1;  /* end of the current token while lex_peek() scans */
+
+/*
+    The last few tokens scanned, the current one at ring_cur. Going back
+    to one of them (the usual case after a $push/$pop lookahead or a short
+    failed alternative) needs no scanning. The ring_ahead entries after
+    ring_cur were scanned by lex_peek() and are handed out next.
+*/
+#define TOK_RING    8   /* power of 2, > LEX_MAX_PEEK+1 */
+static struct {
+    long pos, end;  /* -1 if unused */
+    int tok;
+    char str[MAX_TOKSTR_LEN];
+} ring[TOK_RING] = {
+    { -1, -1 }, { -1, -1 }, { -1, -1 }, { -1, -1 },
+    { -1, -1 }, { -1, -1 }, { -1, -1 }, { -1, -1 },
+};
+static int ring_cur, ring_ahead;
+static char *token_string = ring[0].str;
+
+/*
+    After lex_tokenize(), the tokens of the whole input are in toks[]
+    (their strings in tok_strs) and are read from there instead.
+*/
+static struct LexTok {
+    int tok;
+    int line;       /* lex_lineno() at the token */
+    long pos, end;
+    long str;       /* offset in tok_strs */
+} *toks;
+static long ntoks, tok_idx;
+static char *tok_strs;
+
+static int tok_read(long i);
 
 const char *lex_token_string(void)
 {
+    if (toks != NULL)
+        return tok_strs+toks[tok_idx].str;
     return token_string;
 }
 
-struct LexState {
-    int lineno;
-    char *curr;
-    char token_string[MAX_TOKSTR_LEN];
-};
+const char *lex_last_string(void)
+{
+    if (toks != NULL)
+        return (tok_idx > 0)?tok_strs+toks[tok_idx-1].str:"";
+    return ring[(ring_cur-1)&(TOK_RING-1)].str;
+}
 
-void *lex_get_state(void)
+long lex_token_pos(void)
 {
-    LexState *s;
+    if (toks != NULL)
+        return toks[tok_idx].pos;
+    return ring[ring_cur].pos;
+}
 
-    s = malloc(sizeof(*s));
-    s->lineno = lineno;
-    s->curr = curr;
-    strcpy(s->token_string, token_string);
-    return s;
+int lex_reset(long last, long pos)
+{
+    int i, prev;
+    long lo, hi;
+
+    if (toks != NULL) {
+        for (lo = 0, hi = ntoks-1; lo < hi; ) {
+            if (toks[(lo+hi)/2].pos < pos)
+                lo = (lo+hi)/2+1;
+            else
+                hi = (lo+hi)/2;
+        }
+        tok_idx = lo;
+        return tok_read(tok_idx);
+    }
+    ring_ahead = 0;
+    if (last != -1) {
+        for (i = 0; i < TOK_RING; i++) {
+            prev = (i-1)&(TOK_RING-1);
+            if (ring[i].pos==pos && ring[prev].pos==last) {
+                ring_cur = i;
+                token_string = ring[i].str;
+                curr = buf+(ring[i].end-base);
+                return ring[i].tok;
+            }
+        }
+        pos = last;
+    }
+    assert(pos >= base);
+    curr = buf+(pos-base);
+    ring[ring_cur].pos = -1;
+    ring[ring_cur].str[0] = '\0';
+    i = lex_get_token();
+    return (last != -1)?lex_get_token():i;
 }
 
-void lex_set_state(void *state)
+void lex_set_read_hook(void (*hook)(void))
 {
-    LexState *s;
+    read_hook = hook;
+}
 
-    s = state;
-    lineno = s->lineno;
-    curr = s->curr;
-    strcpy(token_string, s->token_string);
+void lex_set_pin_hook(long (*hook)(void))
+{
+    pin_hook = hook;
+}
+
+/*
+    Drop what nobody can go back to and read more input. Returns 0 at the
+    end of the input.
+*/
+static int fill(void)
+{
+    long keep, pin, drop, off;
+    size_t len;
+    ssize_t n;
+
+    if (in_eof)
+        return 0;
+    keep = base+(long)(curr-buf);
+    if (pin_hook!=NULL && (pin=pin_hook())!=-1 && pin<keep)
+        keep = pin;
+    if (peek_pin!=-1 && peek_pin<keep)
+        keep = peek_pin;
+    if (nl_pos < keep) {
+        nl_count += count_newlines(buf+(nl_pos-base), keep-nl_pos);
+        nl_pos = keep;
+    }
+    drop = keep-base;
+    off = (long)(curr-buf)-drop;
+    len = (size_t)(end-buf-drop);
+    memmove(buf, buf+drop, len);
+    base = keep;
+    if (buf_siz-len-1 < LEX_CHUNK/2) {
+        buf_siz *= 2;
+        buf = realloc(buf, buf_siz);
+    }
+    curr = buf+off;
+    if (read_hook != NULL)
+        read_hook();
+    while ((n=read(in_fd, buf+len, buf_siz-len-1))==-1 && errno==EINTR)
+        ;
+    if (n <= 0) {
+        in_eof = 1;
+        n = 0;
+    }
+    end = buf+len+n;
+    *end = '\0';
+    return n > 0;
 }
 
 enum {
@@ -52,42 +187,127 @@ enum {
     START_KW,
 };
 
+/* indexed by token number */
 static struct {
-    int num;
     char *str;
     char *name;
 } token_table[] = {
-#define X(a, b) { TOK_ ## a, b, # a },
+#define X(a, b) { b, # a },
 #include "tokens.def"
 #undef X
-    { -1, NULL, NULL },
 };
 
+/*
+    Hash tables (open addressing, linear probing) from names and spellings
+    to token numbers. Those of tokens.def are filled on first use, the
+    keywords as they are defined; keyword_table[] maps back from numbers.
+*/
+#define TOK_HASH_SIZE   128 /* power of 2, more than twice the tokens */
+
+static signed char name_hash[TOK_HASH_SIZE], str_hash[TOK_HASH_SIZE]; /* num+1, 0 if free */
+static int tok_hash_done;
+
 static struct Keyword {
     int num;
+    int used;   /* looked up since lex_unuse_keywords() */
     char *str;
     Keyword *next;
-} *keywords;
+} *keywords, **keyword_table, **keyword_hash;
+static int keyword_counter, keyword_hash_size;
+
+static void tok_hash_insert(signed char *tab, const char *key, int num)
+{
+    unsigned h;
+
+    for (h = hash((char *)key); tab[h&(TOK_HASH_SIZE-1)] != 0; h++)
+        ;
+    tab[h&(TOK_HASH_SIZE-1)] = (signed char)(num+1);
+}
+
+static int tok_hash_lookup(signed char *tab, const char *key, int is_name)
+{
+    unsigned h;
+    int i;
+
+    if (!tok_hash_done) {
+        for (i = 0; i < START_KW; i++) {
+            tok_hash_insert(name_hash, token_table[i].name, i);
+            if (token_table[i].str != NULL)
+                tok_hash_insert(str_hash, token_table[i].str, i);
+        }
+        tok_hash_done = 1;
+    }
+    for (h = hash((char *)key); (i=tab[h&(TOK_HASH_SIZE-1)]) != 0; h++)
+        if (strcmp(is_name?token_table[i-1].name:token_table[i-1].str, key) == 0)
+            return i-1;
+    return -1;
+}
+
+/* the keyword spelled s[0..len) with hash value h */
+static Keyword *keyword_find(const char *s, int len, unsigned h)
+{
+    Keyword *t;
+
+    if (keyword_hash == NULL)
+        return NULL;
+    for (; (t=keyword_hash[h&(keyword_hash_size-1)]) != NULL; h++)
+        if (strncmp(t->str, s, len)==0 && t->str[len]=='\0')
+            return t;
+    return NULL;
+}
+
+static void keyword_hash_insert(Keyword *t)
+{
+    unsigned h;
+
+    for (h = hash(t->str); keyword_hash[h&(keyword_hash_size-1)] != NULL; h++)
+        ;
+    keyword_hash[h&(keyword_hash_size-1)] = t;
+}
 
 int lex_keyword(const char *str)
 {
-    Keyword *p, *t;
-    static int keyword_counter;
+    Keyword *t;
 
-    for (p=NULL, t=keywords; t != NULL; p=t, t=t->next)
-        if (strcmp(t->str, str) == 0)
-            return t->num;
+    if ((t=keyword_find(str, (int)strlen(str), hash((char *)str))) != NULL) {
+        t->used = 1;
+        return t->num;
+    }
+    if (2*(keyword_counter+1) > keyword_hash_size) {
+        keyword_hash_size = keyword_hash_size?2*keyword_hash_size:64;
+        free(keyword_hash);
+        keyword_hash = calloc(keyword_hash_size, sizeof(*keyword_hash));
+        for (t = keywords; t != NULL; t = t->next)
+            keyword_hash_insert(t);
+        keyword_table = realloc(keyword_table, keyword_hash_size/2*sizeof(*keyword_table));
+    }
     t = malloc(sizeof(*t));
-    t->num = START_KW+keyword_counter++;
+    t->num = START_KW+keyword_counter;
+    t->used = 1;
     t->str = strdup(str);
     t->next = NULL;
-    if (p != NULL)
-        p->next = t;
+    keyword_table[keyword_counter++] = t;
+    if (keyword_counter > 1)
+        keyword_table[keyword_counter-2]->next = t;
     else
         keywords = t;
+    keyword_hash_insert(t);
     return t->num;
 }
 
+void lex_unuse_keywords(void)
+{
+    Keyword *t;
+
+    for (t = keywords; t != NULL; t = t->next)
+        t->used = 0;
+}
+
+int lex_is_keyword(int num)
+{
+    return num >= START_KW;
+}
+
 const char *lex_keyword_iterate(int begin)
 {
     char *str;
@@ -115,66 +335,106 @@ static int is_id(const char *s)
 
 int lex_lineno(void)
 {
-    return lineno;
+    long pos;
+
+    if (toks != NULL)
+        return (tok_idx >= 0)?toks[tok_idx].line:1;
+    pos = base+(long)(curr-buf);
+    if (pos >= nl_pos)
+        nl_count += count_newlines(buf+(nl_pos-base), pos-nl_pos);
+    else
+        nl_count -= count_newlines(curr, nl_pos-pos);
+    nl_pos = pos;
+    return (int)nl_count+1;
 }
 
 int lex_str2num(const char *str)
 {
-    int i;
-
     if (is_id(str))
         return lex_keyword(str);
-    for (i = 0; token_table[i].num >= 0; i++) {
-        if (token_table[i].str == NULL)
-            continue;
-        if (strcmp(token_table[i].str, str) == 0)
-            return token_table[i].num;
-    }
-    return -1;
+    return tok_hash_lookup(str_hash, str, 0);
 }
 
 int lex_name2num(const char *name)
 {
-    int i;
-
-    for (i = 0; token_table[i].name != NULL; i++)
-        if (strcmp(token_table[i].name, name) == 0)
-            return token_table[i].num;
-    return -1;
+    return tok_hash_lookup(name_hash, name, 1);
 }
 
 const char *lex_num2print(int num)
 {
-    int i;
-
     if (num >= START_KW) {
-        Keyword *t;
-
-        for (t = keywords; t != NULL; t = t->next)
-            if (t->num == num)
-                return t->str;
-    } else {
-        for (i = 0; token_table[i].num >= 0; i++)
-            if (token_table[i].num == num)
-                return (token_table[i].str!=NULL)?token_table[i].str:token_table[i].name;
+        assert(num < START_KW+keyword_counter);
+        return keyword_table[num-START_KW]->str;
     }
-    assert(0);
+    assert(num >= 0);
+    return (token_table[num].str!=NULL)?token_table[num].str:token_table[num].name;
 }
 
 const char *lex_num2name(int num)
 {
-    int i;
-
     if (num >= START_KW)
         return lex_num2print(num);
-    for (i = 0; token_table[i].num >= 0; i++)
-        if (token_table[i].num == num)
-            return token_table[i].name;
-    assert(0);
+    assert(num >= 0);
+    return token_table[num].name;
 }
 
-/* recognize the tokens defined in "tokens.def" */
+static int scan_token(void);
+
 int lex_get_token(void)
+{
+    int tok;
+
+    if (toks != NULL) {
+        if (tok_idx < ntoks-1)
+            ++tok_idx;
+        return tok_read(tok_idx);
+    }
+    ring_cur = (ring_cur+1)&(TOK_RING-1);
+    token_string = ring[ring_cur].str;
+    if (ring_ahead > 0) {
+        --ring_ahead;
+        curr = buf+(ring[ring_cur].end-base);
+        return ring[ring_cur].tok;
+    }
+    tok = scan_token();
+    ring[ring_cur].pos = tok_pos;
+    ring[ring_cur].end = base+(long)(curr-buf);
+    ring[ring_cur].tok = tok;
+    return tok;
+}
+
+/*
+    Scan up to n tokens past the current one into the ring and go back.
+    The bytes after the current token stay in the window meanwhile.
+*/
+int lex_peek(int n)
+{
+    int cur;
+
+    assert(n>=1 && n<=LEX_MAX_PEEK);
+    if (toks != NULL)
+        return tok_read((tok_idx+n < ntoks)?tok_idx+n:ntoks-1);
+    if (n > ring_ahead) {
+        cur = ring_cur;
+        peek_pin = ring[cur].end;
+        curr = buf+(ring[(cur+ring_ahead)&(TOK_RING-1)].end-base);
+        for (; ring_ahead < n; ring_ahead++) {
+            ring_cur = (cur+ring_ahead+1)&(TOK_RING-1);
+            token_string = ring[ring_cur].str;
+            ring[ring_cur].tok = scan_token();
+            ring[ring_cur].pos = tok_pos;
+            ring[ring_cur].end = base+(long)(curr-buf);
+        }
+        ring_cur = cur;
+        token_string = ring[cur].str;
+        curr = buf+(ring[cur].end-base);
+        peek_pin = -1;
+    }
+    return ring[(ring_cur+n)&(TOK_RING-1)].tok;
+}
+
+/* recognize the tokens defined in "tokens.def" */
+static int scan_token(void)
 {
     enum {
         START,
@@ -186,25 +446,34 @@ int lex_get_token(void)
     int state;
     int save, cindx;
     char *str_begin;
-    int str_line;
 
-    if (*curr == '\0')
+    token_string[0] = '\0';
+    tok_pos = base+(long)(curr-buf);
+    if (*curr=='\0' && !fill())
         return TOK_EOF;
 
     cindx = 0;
     state = START;
-    token_string[0] = '\0';
     while (1) {
         int c;
 
         c = *curr++;
+        if (!in_eof && (curr-1==end
+        || (state==START && curr==end && c!='\0' && strchr("<>{}[]:", c)!=NULL))) {
+            /* the window ends within the token (or before the character
+               that tells >= from >, ...): read more and scan it again */
+            curr = buf+(tok_pos-base);
+            fill();
+            state = START;
+            cindx = 0;
+            continue;
+        }
         save = 1;
         switch (state) {
         case START:
+            tok_pos = base+(long)(curr-buf)-1;
             if (c==' ' || c=='\t' || c=='\n') {
                 save = 0;
-                if (c == '\n')
-                    ++lineno;
             } else if (isalpha(c) || c=='_') {
                 state = INID;
             }/*else if (c == '!') {
@@ -217,11 +486,9 @@ int lex_get_token(void)
             } else if (c == '\'') {
                 state = INSTR1;
                 str_begin = curr-1;
-                str_line = lineno;
             } else if (c == '\"') {
                 state = INSTR2;
                 str_begin = curr-1;
-                str_line = lineno;
             } else {
                 switch (c) {
                 case '\0':
@@ -296,9 +563,8 @@ int lex_get_token(void)
 
                 --curr;
                 token_string[cindx] = '\0';
-                for (t = keywords; t != NULL; t = t->next)
-                    if (strcmp(token_string, t->str) == 0)
-                        return t->num;
+                if ((t=keyword_find(token_string, cindx, hash(token_string))) != NULL)
+                    return t->num;
                 return TOK_ID;
             }
             break;
@@ -321,11 +587,8 @@ int lex_get_token(void)
                     c = '\'';
                     --cindx;
                 }
-            } else if (c == '\n') {
-                ++lineno;
-            } else if (c == '\0') {
-                curr = str_begin;
-                lineno = str_line;
+            } else if (c == '\0') {    /* the quote alone, then what follows it */
+                curr = str_begin+1;
                 token_string[0] = '\0';
                 return TOK_UNKNOWN;
             }
@@ -341,11 +604,8 @@ int lex_get_token(void)
                     c = '\"';
                     --cindx;
                 }
-            } else if (c == '\n') {
-                ++lineno;
-            } else if (c == '\0') {
-                curr = str_begin;
-                lineno = str_line;
+            } else if (c == '\0') {    /* the quote alone, then what follows it */
+                curr = str_begin+1;
                 token_string[0] = '\0';
                 return TOK_UNKNOWN;
             }
@@ -361,16 +621,91 @@ int lex_get_token(void)
     assert(0);
 }
 
+long lex_offset(void)
+{
+    if (toks != NULL)
+        return toks[tok_idx].end;
+    return base+(long)(curr-buf);
+}
+
+/* "-" is the standard input */
 int lex_init(char *file_path)
 {
-    if ((buf=read_file(file_path)) == NULL)
+    if (strcmp(file_path, "-") == 0)
+        in_fd = 0;
+    else if ((in_fd=open(file_path, O_RDONLY)) == -1)
+        return -1;
+    buf_siz = 2*LEX_CHUNK;
+    curr = end = buf = malloc(buf_siz);
+    *end = '\0';
+    base = 0;
+    nl_pos = nl_count = 0;
+    in_eof = 0;
+    ring_ahead = 0;
+    fill();
+    return 0;
+}
+
+/* a keyword that was not looked up again is an identifier */
+static int tok_read(long i)
+{
+    int tok;
+
+    tok = toks[i].tok;
+    if (tok>=START_KW && !keyword_table[tok-START_KW]->used)
+        return TOK_ID;
+    return tok;
+}
+
+/*
+    Scan the whole input at once. Processes forked afterwards all read
+    the same tokens, with grammars that may not use all the keywords.
+*/
+int lex_tokenize(char *file_path)
+{
+    struct LexTok *t;
+    long n, max, nstrs, strs_max, len;
+    char *strs;
+    int tok;
+
+    if (lex_init(file_path) == -1)
         return -1;
-    curr = buf;
+    t = NULL;
+    strs = NULL;
+    n = max = strs_max = nstrs = 0;
+    do {
+        tok = lex_get_token();
+        if (n >= max) {
+            max = max*2+1024;
+            t = realloc(t, max*sizeof(*t));
+        }
+        len = (long)strlen(token_string)+1;
+        if (nstrs+len > strs_max) {
+            strs_max = strs_max*2+len+65536;
+            strs = realloc(strs, strs_max);
+        }
+        memcpy(strs+nstrs, token_string, len);
+        t[n].tok = tok;
+        t[n].line = lex_lineno();
+        t[n].pos = ring[ring_cur].pos;
+        t[n].end = ring[ring_cur].end;
+        t[n++].str = nstrs;
+        nstrs += len;
+    } while (tok != TOK_EOF);
+    lex_finish();
+    toks = t;
+    ntoks = n;
+    tok_strs = strs;
+    tok_idx = -1;
     return 0;
 }
 
 int lex_finish(void)
 {
+    if (in_fd > 0)
+        close(in_fd);
+    in_fd = -1;
     free(buf);
+    buf = NULL;
     return 0;
 }
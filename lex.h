@@ -2,14 +2,21 @@
 #define LEX_H_
 
 #define MAX_TOKSTR_LEN 512
+#define LEX_MAX_PEEK   6
 
 int lex_init(char *file_path);
 int lex_get_token(void);
+int lex_peek(int n);    /* token n past the current one, 1 <= n <= LEX_MAX_PEEK */
 int lex_finish(void);
+int lex_tokenize(char *file_path);  /* scan the whole input now, then read the tokens from memory */
 int lex_lineno(void);
+long lex_offset(void);  /* offset in the input just past the current token */
+long lex_token_pos(void);   /* offset where the current token begins */
+int lex_reset(long last, long pos); /* go back to the token at pos, preceded by the one at last (or -1) */
 const char *lex_token_string(void);
-void *lex_get_state(void);
-void lex_set_state(void *state);
+const char *lex_last_string(void);  /* string of the token before the current one */
+void lex_set_read_hook(void (*hook)(void)); /* called before reading more input */
+void lex_set_pin_hook(long (*hook)(void));  /* lowest offset lex_reset() may go back to, -1 if none */
 
 int lex_name2num(const char *name); /* e.g. "PLUS" -> 1 */
 int lex_str2num(const char *str);   /* e.g. "+" -> 1 */
@@ -17,6 +24,8 @@ const char *lex_num2print(int num); /* e.g. 1 -> "+" */
 const char *lex_num2name(int num);  /* e.g. 1 -> "PLUS" */
 
 int lex_keyword(const char *str);
+void lex_unuse_keywords(void);  /* after lex_tokenize(), keywords not looked up again read as ID */
+int lex_is_keyword(int num);
 const char *lex_keyword_iterate(int begin);
 
 #endif
@@ -16,4 +16,378 @@ for gfile in `ls -v examples/*.ebnf` ; do
     let strcnt=strcnt+1
 done
 
+# the recognizers generated with -g (and -g -s) must behave like the interpreter;
+# those with the specialized lexer are self-contained
+for genopt in "" "-s" ; do
+    if [ "$genopt" = "-s" ] ; then
+        libsrc=""
+    else
+        libsrc="lex.c util.c -I."
+    fi
+    strcnt=1
+    for gfile in `ls -v examples/*.ebnf` ; do
+        ./genrec $gfile -g $genopt -o "examples/rec$strcnt.c" 2>/dev/null &&
+        ${CC:-cc} -Wall -Werror -o "examples/rec$strcnt" "examples/rec$strcnt.c" $libsrc 2>/dev/null &&
+        "examples/rec$strcnt" "examples/string$strcnt" >"examples/$strcnt.output" 2>/dev/null
+        if [ "$?" = "0" ] && cmp -s "examples/$strcnt.output" "examples/$strcnt.expect" ; then
+            echo "==> Grammar: $gfile, String: string$strcnt, Generated $genopt [PASS]"
+            let pass=pass+1
+        else
+            echo "==> Grammar: $gfile, String: string$strcnt, Generated $genopt [FAIL]"
+            let fail=fail+1
+        fi
+        rm -f "examples/rec$strcnt.c" "examples/rec$strcnt"
+        let strcnt=strcnt+1
+    done
+done
+
+# [[ ]] sites decided by lookahead (-k) must not change the output
+strcnt=1
+for gfile in `ls -v examples/*.ebnf` ; do
+    if grep -q '\[\[' $gfile ; then
+        ./genrec $gfile "examples/string$strcnt" -k3 >"examples/$strcnt.output" 2>/dev/null &&
+        cmp -s "examples/$strcnt.output" "examples/$strcnt.expect" &&
+        ./genrec $gfile -g -k3 -o "examples/rec$strcnt.c" 2>/dev/null &&
+        ${CC:-cc} -o "examples/rec$strcnt" "examples/rec$strcnt.c" lex.c util.c -I. 2>/dev/null &&
+        "examples/rec$strcnt" "examples/string$strcnt" >"examples/$strcnt.output" 2>/dev/null
+        if [ "$?" = "0" ] && cmp -s "examples/$strcnt.output" "examples/$strcnt.expect" ; then
+            echo "==> Grammar: $gfile, String: string$strcnt, Lookahead [PASS]"
+            let pass=pass+1
+        else
+            echo "==> Grammar: $gfile, String: string$strcnt, Lookahead [FAIL]"
+            let fail=fail+1
+        fi
+        rm -f "examples/rec$strcnt.c" "examples/rec$strcnt"
+    fi
+    let strcnt=strcnt+1
+done
+
+# alternatives of | tested in the order of a profile (-P, -U) must not change the output
+strcnt=1
+for gfile in `ls -v examples/*.ebnf` ; do
+    rm -f examples/branches.txt
+    ./genrec $gfile -r16K -S7 >examples/random.txt 2>/dev/null &&
+    ./genrec $gfile examples/random.txt -Pexamples/branches.txt >/dev/null 2>&1 &&
+    ./genrec $gfile "examples/string$strcnt" -Uexamples/branches.txt >"examples/$strcnt.output" 2>/dev/null &&
+    cmp -s "examples/$strcnt.output" "examples/$strcnt.expect" &&
+    ./genrec $gfile -g -Uexamples/branches.txt -o "examples/rec$strcnt.c" 2>/dev/null &&
+    ${CC:-cc} -o "examples/rec$strcnt" "examples/rec$strcnt.c" lex.c util.c -I. 2>/dev/null &&
+    "examples/rec$strcnt" "examples/string$strcnt" >"examples/$strcnt.output" 2>/dev/null
+    if [ "$?" = "0" ] && cmp -s "examples/$strcnt.output" "examples/$strcnt.expect" ; then
+        echo "==> Grammar: $gfile, String: string$strcnt, Branch profile [PASS]"
+        let pass=pass+1
+    else
+        echo "==> Grammar: $gfile, String: string$strcnt, Branch profile [FAIL]"
+        let fail=fail+1
+    fi
+    rm -f "examples/rec$strcnt.c" "examples/rec$strcnt"
+    let strcnt=strcnt+1
+done
+rm -f examples/branches.txt examples/random.txt
+
+# adaptive prediction (-a) must not change the output, also with the DFAs of a previous run
+strcnt=1
+for gfile in `ls -v examples/*.ebnf` ; do
+    rm -f examples/dfa.txt
+    ./genrec $gfile "examples/string$strcnt" -aexamples/dfa.txt >"examples/$strcnt.output" 2>/dev/null &&
+    cmp -s "examples/$strcnt.output" "examples/$strcnt.expect" &&
+    ./genrec $gfile "examples/string$strcnt" -aexamples/dfa.txt >"examples/$strcnt.output" 2>/dev/null
+    if [ "$?" = "0" ] && cmp -s "examples/$strcnt.output" "examples/$strcnt.expect" ; then
+        echo "==> Grammar: $gfile, String: string$strcnt, Adaptive [PASS]"
+        let pass=pass+1
+    else
+        echo "==> Grammar: $gfile, String: string$strcnt, Adaptive [FAIL]"
+        let fail=fail+1
+    fi
+    let strcnt=strcnt+1
+done
+rm -f examples/dfa.txt
+if echo "abc()" | ./genrec examples/grammar7.ebnf - -a >/dev/null 2>&1 ; then
+    echo "==> Grammar: examples/grammar7.ebnf, String: abc(), Adaptive [PASS]"
+    let pass=pass+1
+else
+    echo "==> Grammar: examples/grammar7.ebnf, String: abc(), Adaptive [FAIL]"
+    let fail=fail+1
+fi
+# the DFAs saved with -a<file> load back, also their paths through keywords
+printf 's* = { stmt } ;\nstmt = #ID "is" #NUM ";" | #ID "is" #ID ";" ; .\n' >examples/many.txt
+echo "a is 1 ; b is c ;" >examples/random.txt
+rm -f examples/dfa.txt
+./genrec examples/many.txt examples/random.txt -aexamples/dfa.txt >/dev/null 2>&1
+cp examples/dfa.txt examples/dfa.expect
+echo "" >examples/random.txt
+./genrec examples/many.txt examples/random.txt -aexamples/dfa.txt >/dev/null 2>&1
+if grep -q ' is ' examples/dfa.expect && cmp -s examples/dfa.txt examples/dfa.expect ; then
+    echo "==> Grammar: keyword conflict, DFA cache round trip [PASS]"
+    let pass=pass+1
+else
+    echo "==> Grammar: keyword conflict, DFA cache round trip [FAIL]"
+    let fail=fail+1
+fi
+rm -f examples/many.txt examples/random.txt examples/dfa.txt examples/dfa.expect
+
+# a binary trace (-T) decodes to the same derivation -v prints
+strcnt=1
+for gfile in `ls -v examples/*.ebnf` ; do
+    ./genrec $gfile "examples/string$strcnt" -v 2>/dev/null | grep -oE -- '-*(>>|<<) .*' >"examples/$strcnt.output"
+    ./genrec $gfile "examples/string$strcnt" -Texamples/trace.bin >/dev/null 2>&1
+    if ./tracedump examples/trace.bin | cmp -s - "examples/$strcnt.output" ; then
+        echo "==> Grammar: $gfile, String: string$strcnt, Trace [PASS]"
+        let pass=pass+1
+    else
+        echo "==> Grammar: $gfile, String: string$strcnt, Trace [FAIL]"
+        let fail=fail+1
+    fi
+    let strcnt=strcnt+1
+done
+rm -f examples/trace.bin
+
+# the event stream (-E) has each token of the input, in the order -v matched
+# them: all of those, less what [[ ]] rolled back; each token once, unless
+# $pop goes back over it
+strcnt=1
+for gfile in `ls -v examples/*.ebnf` ; do
+    ./genrec $gfile "examples/string$strcnt" -Eexamples/events.bin >/dev/null 2>&1
+    ./tracedump examples/events.bin | LC_ALL=C awk '
+        NR == FNR { start[FNR] = pos; pos += length($0)+1; n = FNR; next }
+        /\x27 [0-9]+ [0-9]+$/ {
+            for (l = 1; l < n && start[l+1] <= $(NF-1); l++)
+                ;
+            print $(NF-2), l, $(NF-1)
+        }' "examples/string$strcnt" - >"examples/$strcnt.output"
+    ./genrec $gfile "examples/string$strcnt" -v 2>/dev/null |
+    sed -nE "s/.*<< matched (\`.*') \(.*:([0-9]+)\)$/\1 \2/p" >"examples/$strcnt.expect.events"
+    ntok=`./genrec $gfile "examples/string$strcnt" -t`
+    if awk 'NR == FNR { v[++n] = $0; next }
+            { for (i++; i <= n && v[i] != $1" "$2; i++) ; if (i > n) bad = 1 }
+            END { exit bad }' "examples/$strcnt.expect.events" "examples/$strcnt.output" &&
+    { grep -q '\[\[' $gfile || [ "`wc -l <"examples/$strcnt.output"`" = "`wc -l <"examples/$strcnt.expect.events"`" ] ; } &&
+    [ "`awk '{ print $3 }' "examples/$strcnt.output" | sort -u | wc -l`" = "$ntok" ] &&
+    { grep -q '\$pop' $gfile || [ "`wc -l <"examples/$strcnt.output"`" = "$ntok" ] ; } ; then
+        echo "==> Grammar: $gfile, String: string$strcnt, Events [PASS]"
+        let pass=pass+1
+    else
+        echo "==> Grammar: $gfile, String: string$strcnt, Events [FAIL]"
+        let fail=fail+1
+    fi
+    rm -f "examples/$strcnt.expect.events"
+    let strcnt=strcnt+1
+done
+rm -f examples/events.bin
+
+# a token hook (REC_TOKEN) compiled into a generated recognizer sees the
+# spans that -E writes (in grammars without [[ ]], whose attempts it sees too)
+for genopt in "" "-s" ; do
+    strcnt=1
+    for gfile in `ls -v examples/*.ebnf` ; do
+        if ! grep -q '\[\[' $gfile ; then
+            ./genrec $gfile "examples/string$strcnt" -Eexamples/events.bin >/dev/null 2>&1
+            ./tracedump examples/events.bin | grep "' [0-9]* [0-9]*$" | awk '{ print $(NF-1), $NF }' >"examples/$strcnt.expect.hooks"
+            ./genrec $gfile -g $genopt -o "examples/rec$strcnt.c" 2>/dev/null &&
+            ${CC:-cc} -o "examples/rec$strcnt" "examples/rec$strcnt.c" lex.c util.c -I. \
+            '-DREC_TOKEN(t,p,l)=fprintf(stderr, "%ld %ld\n", (long)(p), (long)(l))' 2>/dev/null &&
+            "examples/rec$strcnt" "examples/string$strcnt" 2>"examples/$strcnt.output" >/dev/null
+            if [ "$?" = "0" ] && cmp -s "examples/$strcnt.output" "examples/$strcnt.expect.hooks" ; then
+                echo "==> Grammar: $gfile, String: string$strcnt, Hooks $genopt [PASS]"
+                let pass=pass+1
+            else
+                echo "==> Grammar: $gfile, String: string$strcnt, Hooks $genopt [FAIL]"
+                let fail=fail+1
+            fi
+            rm -f "examples/rec$strcnt.c" "examples/rec$strcnt" "examples/$strcnt.expect.hooks"
+        fi
+        let strcnt=strcnt+1
+    done
+done
+rm -f examples/events.bin
+
+# REC_ENTER and REC_EXIT stay balanced through failed [[ ]] attempts, and
+# see the rules the interpreter enters (-v)
+for genopt in "" "-s" ; do
+    strcnt=1
+    for gfile in `ls -v examples/*.ebnf` ; do
+        if grep -q '\[\[' $gfile ; then
+            nrules=`./genrec $gfile "examples/string$strcnt" -v 2>/dev/null | grep -c '>> replacing'`
+            ./genrec $gfile -g $genopt -o "examples/rec$strcnt.c" 2>/dev/null &&
+            ${CC:-cc} -o "examples/rec$strcnt" "examples/rec$strcnt.c" lex.c util.c -I. \
+            '-DREC_ENTER(r)=fprintf(stderr, "+\n")' '-DREC_EXIT(r,ok)=fprintf(stderr, "-\n")' 2>/dev/null &&
+            "examples/rec$strcnt" "examples/string$strcnt" 2>"examples/$strcnt.output" >/dev/null
+            if [ "$?" = "0" ] && [ "`grep -c '+' examples/$strcnt.output`" = "$nrules" ] &&
+            [ "`grep -c -- '-' examples/$strcnt.output`" = "$nrules" ] ; then
+                echo "==> Grammar: $gfile, String: string$strcnt, Rule hooks $genopt [PASS]"
+                let pass=pass+1
+            else
+                echo "==> Grammar: $gfile, String: string$strcnt, Rule hooks $genopt [FAIL]"
+                let fail=fail+1
+            fi
+            rm -f "examples/rec$strcnt.c" "examples/rec$strcnt"
+        fi
+        let strcnt=strcnt+1
+    done
+done
+
+# random sentences (-r) must be accepted by the grammar they come from
+for gfile in `ls -v examples/*.ebnf` ; do
+    ./genrec $gfile -r16K -S7 >examples/random.txt 2>/dev/null &&
+    ./genrec $gfile examples/random.txt >/dev/null 2>&1
+    if [ "$?" = "0" ] ; then
+        echo "==> Grammar: $gfile, Random string [PASS]"
+        let pass=pass+1
+    else
+        echo "==> Grammar: $gfile, Random string [FAIL]"
+        let fail=fail+1
+    fi
+done
+# also under more nested $push than a fixed stack would hold
+{
+    echo 's* = r0 { "," r0 } ;'
+    for i in `seq 0 19` ; do
+        echo "r$i = \$push r$((i+1)) \$pop #ID ;"
+    done
+    echo 'r20 = #ID [ #NUM ] ; .'
+} >examples/many.txt
+if ./genrec examples/many.txt -r1K -S7 >examples/random.txt 2>/dev/null &&
+./genrec examples/many.txt examples/random.txt >/dev/null 2>&1 ; then
+    echo "==> Grammar: 20 nested \$push, Random string [PASS]"
+    let pass=pass+1
+else
+    echo "==> Grammar: 20 nested \$push, Random string [FAIL]"
+    let fail=fail+1
+fi
+rm -f examples/random.txt examples/many.txt
+
+# -m: one scan of the input, each grammar as if run alone
+strcnt=1
+for gfile in `ls -v examples/*.ebnf` ; do
+    ./genrec -m"examples/string$strcnt" $gfile examples/grammar8.ebnf >examples/random.txt 2>&1
+    if [ "`head -1 examples/random.txt`" = "==> $gfile [PASS]" ] &&
+    awk 'NR>1 && /^==> /{exit} NR>1' examples/random.txt | cmp -s - "examples/$strcnt.expect" ; then
+        echo "==> Grammar: $gfile, String: string$strcnt, Several grammars [PASS]"
+        let pass=pass+1
+    else
+        echo "==> Grammar: $gfile, String: string$strcnt, Several grammars [FAIL]"
+        let fail=fail+1
+    fi
+    let strcnt=strcnt+1
+done
+rm -f examples/random.txt
+
+# a slow pipe: the first line is recognized before the second arrives
+(printf '1 .\n'; sleep 2; printf '2 .\n') | ./genrec examples/grammar1.ebnf - -v >examples/random.txt 2>&1 &
+sleep 1
+if [ "`grep -c NUM examples/random.txt`" = "1" ] ; then
+    echo "==> Grammar: examples/grammar1.ebnf, Slow pipe [PASS]"
+    let pass=pass+1
+else
+    echo "==> Grammar: examples/grammar1.ebnf, Slow pipe [FAIL]"
+    let fail=fail+1
+fi
+wait
+rm -f examples/random.txt
+
+# the specialized lexer names the tokens the grammar does not use as lex.c does
+./genrec examples/grammar1.ebnf -g -s -o examples/rec.c &&
+${CC:-cc} -o examples/rec examples/rec.c 2>/dev/null
+for input in "1 @ ." "1 'x' ." ; do
+    echo "$input" >examples/random.txt
+    if [ "`./genrec examples/grammar1.ebnf examples/random.txt 2>&1 | sed 's/^[^:]*: //'`" = \
+    "`examples/rec examples/random.txt 2>&1 | sed 's/^[^:]*: //'`" ] ; then
+        echo "==> Grammar: examples/grammar1.ebnf, String: $input, Token names -s [PASS]"
+        let pass=pass+1
+    else
+        echo "==> Grammar: examples/grammar1.ebnf, String: $input, Token names -s [FAIL]"
+        let fail=fail+1
+    fi
+done
+rm -f examples/random.txt examples/rec.c examples/rec
+
+# -e: one report per mistake, the same from the generated recognizers;
+# 3 errors fit in -e3, not in -e2
+printf '{\n "a": [1 2],\n "c" 3,\n "b": [1, , 2]\n}\n' >examples/random.txt
+for genopt in "" "-s" ; do
+    if [ "$genopt" = "-s" ] ; then
+        libsrc=""
+    else
+        libsrc="lex.c util.c -I."
+    fi
+    ./genrec examples/grammar8.ebnf -g $genopt -e3 -o examples/rec.c &&
+    ${CC:-cc} -Wall -Werror -o examples/rec examples/rec.c $libsrc 2>/dev/null
+    if [ "`./genrec examples/grammar8.ebnf examples/random.txt -e 2>&1 | grep -c ':[234]: error: '`" = "3" ] &&
+    [ "`examples/rec examples/random.txt 2>&1 | grep -c ':[234]: error: '`" = "3" ] &&
+    ! examples/rec examples/random.txt 2>&1 | grep -q 'too many errors' &&
+    ! examples/rec examples/random.txt >/dev/null 2>&1 &&
+    ! ./genrec examples/grammar8.ebnf examples/random.txt -e3 2>&1 | grep -q 'too many errors' &&
+    ./genrec examples/grammar8.ebnf examples/random.txt -e2 2>&1 | grep -q 'too many errors' ; then
+        echo "==> Grammar: examples/grammar8.ebnf, Error recovery $genopt [PASS]"
+        let pass=pass+1
+    else
+        echo "==> Grammar: examples/grammar8.ebnf, Error recovery $genopt [FAIL]"
+        let fail=fail+1
+    fi
+done
+rm -f examples/random.txt examples/rec.c examples/rec
+
+# -L: an exponential [[ ]] grammar stops with status 3 on each budget
+{
+    echo 's* = r0 ;'
+    for i in `seq 0 19` ; do
+        echo "r$i = [[ r$((i+1)) \"x\" | r$((i+1)) \"y\" ]] ;"
+    done
+    echo 'r20 = "z" ; .'
+} >examples/many.txt
+echo "z y y y y y y y y y y y y y y y y y y y y" >examples/random.txt
+for budget in steps=1000 rollbacks=100 depth=10 time=50 ; do
+    ./genrec examples/many.txt examples/random.txt -L$budget >/dev/null 2>&1
+    if [ "$?" = "3" ] ; then
+        echo "==> Budget: $budget [PASS]"
+        let pass=pass+1
+    else
+        echo "==> Budget: $budget [FAIL]"
+        let fail=fail+1
+    fi
+done
+if ./genrec examples/grammar12.ebnf examples/string12 -Lsteps=1000000,rollbacks=100000,depth=1000,time=60000 2>/dev/null |
+cmp -s - examples/12.expect ; then
+    echo "==> Budget: within all [PASS]"
+    let pass=pass+1
+else
+    echo "==> Budget: within all [FAIL]"
+    let fail=fail+1
+fi
+./genrec examples/grammar10.ebnf examples/string10 -Lsteps=20 >examples/random.txt 2>/dev/null
+if [ "$?" = "3" ] && [ -s examples/random.txt ] &&
+cmp examples/random.txt examples/10.expect 2>&1 | grep -q 'EOF on examples/random.txt' ; then
+    echo "==> Budget: output recognized so far [PASS]"
+    let pass=pass+1
+else
+    echo "==> Budget: output recognized so far [FAIL]"
+    let fail=fail+1
+fi
+if ./genrec examples/grammar1.ebnf examples/string1 -Lsteps=-5 >/dev/null 2>&1 ; then
+    echo "==> Budget: negative value rejected [FAIL]"
+    let fail=fail+1
+else
+    echo "==> Budget: negative value rejected [PASS]"
+    let pass=pass+1
+fi
+rm -f examples/many.txt examples/random.txt
+
+# a grammar with many rules
+{
+    echo 's* = r0 ;'
+    for i in `seq 0 1998` ; do
+        echo "r$i = #NUM {{ \"$i \" }} [ r$((i+1)) > \$b ] {{ \$b }} ;"
+    done
+    echo 'r1999 = #ID ; .'
+} >examples/many.txt
+echo "1 2 3" >examples/random.txt
+if [ "`./genrec examples/many.txt examples/random.txt -c 2>/dev/null`" = "0 1 2 " ] ; then
+    echo "==> Grammar: 2000 rules [PASS]"
+    let pass=pass+1
+else
+    echo "==> Grammar: 2000 rules [FAIL]"
+    let fail=fail+1
+fi
+rm -f examples/many.txt examples/random.txt
+
 echo "Pass: $pass, Fail: $fail"
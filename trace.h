@@ -0,0 +1,75 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+
+/*
+    Binary traces written by `genrec -T<file>' and read by tracedump.
+
+    The file holds a TraceHeader, the names (NUL-terminated strings: the
+    input file, the nrules rule names and the TRACE_NTOKENS token strings,
+    empty for tokens the grammar does not use), padded to a multiple of 16
+    bytes, and a ring of capacity (a power of 2) records. Record i is at
+    ring[i & (capacity-1)]; the last min(count, capacity) are valid.
+*/
+#define TRACE_MAGIC     "GRTRACE2"
+#define TRACE_NTOKENS   64
+
+enum {
+    TR_ENTER,   /* id: rule */
+    TR_EXIT,    /* id: rule, flags: 1 if recognized */
+    TR_MATCH,   /* id: token */
+};
+
+typedef struct TraceRec {
+    uint8_t event;
+    uint8_t flags;
+    uint16_t depth;     /* rules in progress */
+    int32_t id;
+    uint64_t offset;    /* in the input, just past the lookahead token */
+    uint32_t line;
+    uint32_t pad;
+} TraceRec;
+
+typedef struct TraceHeader {
+    char magic[8];
+    uint32_t capacity;
+    uint32_t names_size;
+    uint32_t nrules;
+    uint32_t pad;
+    uint64_t count;     /* records written so far */
+} TraceHeader;
+
+/*
+    Event streams written by `genrec -E<file>': the derivation that was
+    finally taken (attempts that backtracking took back are not in it).
+
+    The file holds an EventHeader, the names as in a trace (not padded)
+    and then the events up to the end of the file. Each event is a byte
+    followed by unsigned LEB128 numbers:
+
+        EV_ENTER rule
+        EV_TOKEN token gap length
+        EV_EXIT
+
+    The span of a token in the input begins gap bytes after the end of
+    the span of the token before (or after offset 0), zigzag encoded: 2n
+    for n >= 0, -2n-1 for n < 0 (a $pop goes back).
+
+    A stream cut short (a syntax error) has fewer EV_EXITs than EV_ENTERs.
+*/
+#define EVENT_MAGIC     "GREVENT1"
+
+enum {
+    EV_ENTER,
+    EV_TOKEN,
+    EV_EXIT,
+};
+
+typedef struct EventHeader {
+    char magic[8];
+    uint32_t names_size;
+    uint32_t nrules;
+} EventHeader;
+
+#endif
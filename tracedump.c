@@ -0,0 +1,252 @@
+/*
+    Decoder for the binary traces written by `genrec -T<file>' and the
+    event streams written by `genrec -E<file>'.
+
+    By default the records of a trace are printed in the format of
+    `genrec -v'; the events of a stream as a tree, a rule or a token
+    (with the offset and length of its span) per line, indented by depth.
+    With -f, the token matches are counted per stack of rules and printed
+    as folded stacks ("rule;rule;rule count"), ready for flamegraph.pl.
+    If the ring wrapped around, the rules entered before its oldest record
+    are shown as `?'.
+
+    usage: tracedump [ -f ] <trace_file>
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+#include "trace.h"
+
+#define HASH_SIZE   4093
+
+static char *prog_name;
+static char **rule_names, *tok_names[TRACE_NTOKENS], *input_path;
+static int nrules;
+
+#define DIE(...)                            \
+    do {                                    \
+        fprintf(stderr, "%s: ", prog_name); \
+        fprintf(stderr, __VA_ARGS__);       \
+        fprintf(stderr, "\n");              \
+        exit(EXIT_FAILURE);                 \
+    } while (0)
+
+static char *rule_name(int num)
+{
+    return (num>=0 && num<nrules)?rule_names[num]:"?";
+}
+
+static char *tok_name(int num)
+{
+    return (num>=0 && num<TRACE_NTOKENS)?tok_names[num]:"?";
+}
+
+static void print_text(TraceRec *r)
+{
+    int i;
+
+    if (r->event == TR_EXIT)
+        return;
+    for (i = r->depth; i; i--)
+        printf("--");
+    if (r->event == TR_ENTER)
+        printf(">> replacing `%s' (%s:%u)\n", rule_name(r->id), input_path, r->line);
+    else
+        printf("<< matched `%s' (%s:%u)\n", tok_name(r->id), input_path, r->line);
+}
+
+static struct Folded {
+    char *stack;
+    unsigned long count;
+    struct Folded *next;
+} *folded[HASH_SIZE];
+
+static int *stack;
+static int stack_max;
+
+static void fold(TraceRec *r)
+{
+    struct Folded *f;
+    StrBuf *key;
+    unsigned h;
+    int i;
+
+    if (r->depth >= stack_max) {
+        i = stack_max;
+        stack_max = r->depth*2+64;
+        stack = realloc(stack, stack_max*sizeof(*stack));
+        for (; i < stack_max; i++)
+            stack[i] = -1;
+    }
+    if (r->event == TR_ENTER) {
+        stack[r->depth] = r->id;
+        return;
+    }
+    if (r->event != TR_MATCH)
+        return;
+    key = strbuf_new(256);
+    for (i = 0; i < r->depth; i++)
+        strbuf_printf(key, "%s%s", i?";":"", rule_name(stack[i]));
+    h = hash(strbuf_str(key))%HASH_SIZE;
+    for (f = folded[h]; f != NULL; f = f->next)
+        if (strcmp(f->stack, strbuf_str(key)) == 0)
+            break;
+    if (f == NULL) {
+        f = malloc(sizeof(*f));
+        f->stack = strdup(strbuf_str(key));
+        f->count = 0;
+        f->next = folded[h];
+        folded[h] = f;
+    }
+    ++f->count;
+    strbuf_destroy(key);
+}
+
+static int read_num(FILE *fp, unsigned long *v)
+{
+    int c, shift;
+
+    *v = 0;
+    for (shift = 0; (c=getc(fp)) != EOF; shift += 7) {
+        *v |= (unsigned long)(c&0x7F) << shift;
+        if (!(c & 0x80))
+            return 1;
+    }
+    return 0;
+}
+
+/* the events after the header (already read) */
+static void dump_events(FILE *fp, char *path, int folded_output)
+{
+    TraceRec r;
+    unsigned long id, gap, len, pos, end;
+    int c, depth;
+
+    depth = 0;
+    end = 0;
+    while ((c=getc(fp)) != EOF) {
+        id = gap = len = 0;
+        if ((c!=EV_EXIT && !read_num(fp, &id))
+        || (c==EV_TOKEN && (!read_num(fp, &gap) || !read_num(fp, &len))))
+            DIE("`%s' is truncated", path);
+        if (c == EV_TOKEN) {
+            pos = (gap & 1)?end-(gap+1)/2:end+gap/2;
+            end = pos+len;
+        }
+        if (c == EV_EXIT) {
+            if (--depth < 0)
+                DIE("`%s' is corrupt", path);
+            continue;
+        }
+        if (folded_output) {
+            r.event = (c == EV_ENTER)?TR_ENTER:TR_MATCH;
+            r.depth = (uint16_t)depth;
+            r.id = (int32_t)id;
+            fold(&r);
+        } else {
+            printf("%*s", 2*depth, "");
+            if (c == EV_ENTER)
+                printf("%s\n", rule_name((int)id));
+            else
+                printf("`%s' %lu %lu\n", tok_name((int)id), pos, len);
+        }
+        if (c == EV_ENTER)
+            ++depth;
+    }
+}
+
+static void read_names(char *names)
+{
+    char *p;
+    int i;
+
+    rule_names = malloc((nrules+1)*sizeof(*rule_names));
+    p = input_path = names;
+    for (i = 0; i < nrules; i++)
+        rule_names[i] = p += strlen(p)+1;
+    for (i = 0; i < TRACE_NTOKENS; i++)
+        tok_names[i] = p += strlen(p)+1;
+}
+
+/* the names and the ring after the header (already read) */
+static void dump_trace(FILE *fp, char *path, TraceHeader *hdr, int folded_output)
+{
+    TraceRec *ring;
+    char *names;
+    uint64_t i, n;
+
+    names = malloc(hdr->names_size);
+    ring = malloc((size_t)hdr->capacity*sizeof(TraceRec));
+    if (fread(names, 1, hdr->names_size, fp) != hdr->names_size
+    || fread(ring, sizeof(TraceRec), hdr->capacity, fp) != hdr->capacity)
+        DIE("`%s' is truncated", path);
+    fclose(fp);
+    nrules = (int)hdr->nrules;
+    read_names(names);
+
+    n = (hdr->count > hdr->capacity)?hdr->count-hdr->capacity:0;
+    for (i = n; i < hdr->count; i++) {
+        TraceRec *r;
+
+        r = &ring[i & (hdr->capacity-1)];
+        if (folded_output)
+            fold(r);
+        else
+            print_text(r);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *fp;
+    TraceHeader hdr;
+    EventHeader ehdr;
+    char *names;
+    int folded_output, bad, k;
+    char *path;
+
+    prog_name = argv[0];
+    folded_output = bad = 0;
+    path = NULL;
+    for (k = 1; k < argc; k++) {
+        if (strcmp(argv[k], "-f") == 0)
+            folded_output = 1;
+        else if (argv[k][0]!='-' && path==NULL)
+            path = argv[k];
+        else
+            bad = 1;
+    }
+    if (path==NULL || bad) {
+        fprintf(stderr, "usage: %s [ -f ] <trace_file>\n", prog_name);
+        exit(EXIT_FAILURE);
+    }
+
+    if ((fp=fopen(path, "rb")) == NULL)
+        DIE("cannot open `%s'", path);
+    if (fread(&ehdr, sizeof(ehdr), 1, fp)==1 && memcmp(ehdr.magic, EVENT_MAGIC, sizeof(ehdr.magic))==0) {
+        names = malloc(ehdr.names_size);
+        if (fread(names, 1, ehdr.names_size, fp) != ehdr.names_size)
+            DIE("`%s' is truncated", path);
+        nrules = (int)ehdr.nrules;
+        read_names(names);
+        dump_events(fp, path, folded_output);
+        fclose(fp);
+    } else {
+        rewind(fp);
+        if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0)
+            DIE("`%s' is not a trace file", path);
+        dump_trace(fp, path, &hdr, folded_output);
+    }
+    if (folded_output) {
+        int h;
+
+        for (h = 0; h < HASH_SIZE; h++) {
+            struct Folded *f;
+
+            for (f = folded[h]; f != NULL; f = f->next)
+                printf("%s %lu\n", f->stack, f->count);
+        }
+    }
+    return 0;
+}
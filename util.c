@@ -2,13 +2,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
+#include <stdint.h>
 
+/* FNV-1a */
 unsigned hash(char *s)
 {
     unsigned hash_val;
 
-    for (hash_val = 0; *s != '\0'; s++)
-        hash_val = (unsigned)*s + 31*hash_val;
+    for (hash_val = 2166136261u; *s != '\0'; s++)
+        hash_val = (hash_val^(unsigned char)*s)*16777619u;
     return hash_val;
 }
 
@@ -30,19 +33,46 @@ char *read_file(char *path)
     return buf;
 }
 
+/*
+    Number of '\n' in s[0..n). Eight bytes at a time: a byte of x is zero
+    iff it was a new-line, and those are the bytes left without their high
+    bit below.
+*/
+long count_newlines(const char *s, long n)
+{
+    const uint64_t ones = 0x0101010101010101ULL, highs = 0x8080808080808080ULL;
+    long cnt;
+
+    cnt = 0;
+    for (; n >= 8; s += 8, n -= 8) {
+        uint64_t x, t;
+
+        memcpy(&x, s, 8);
+        x ^= '\n'*ones;
+        t = ((x&~highs)+~highs) | x;
+        cnt += __builtin_popcountll(~t & highs);
+    }
+    for (; n > 0; s++, n--)
+        cnt += (*s == '\n');
+    return cnt;
+}
+
 struct StrBuf {
     char *buf;
     int siz, pos;
+    long base;  /* bytes flushed so far */
 };
 
-int strbuf_get_pos(StrBuf *sbuf)
+/* positions count from the start of the output, flushed bytes included */
+long strbuf_get_pos(StrBuf *sbuf)
 {
-    return sbuf->pos;
+    return sbuf->base+sbuf->pos;
 }
 
-void strbuf_set_pos(StrBuf *sbuf, int pos)
+void strbuf_set_pos(StrBuf *sbuf, long pos)
 {
-    sbuf->pos = pos;
+    sbuf->pos = (int)(pos-sbuf->base);
+    sbuf->buf[sbuf->pos] = '\0';
 }
 
 StrBuf *strbuf_new(int n)
@@ -54,6 +84,7 @@ StrBuf *strbuf_new(int n)
     sbuf->buf[0] = '\0';
     sbuf->siz = n;
     sbuf->pos = 0;
+    sbuf->base = 0;
     return sbuf;
 }
 
@@ -85,15 +116,73 @@ int strbuf_printf(StrBuf *sbuf, char *fmt, ...)
     return n;
 }
 
+static void strbuf_reserve(StrBuf *sbuf, int n)
+{
+    if (sbuf->pos+n < sbuf->siz)
+        return;
+    sbuf->siz = sbuf->siz*2+n;
+    if ((sbuf->buf=realloc(sbuf->buf, sbuf->siz)) == NULL) {
+        fprintf(stderr, "Out of memory");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void strbuf_append(StrBuf *sbuf, const char *s, int n)
+{
+    strbuf_reserve(sbuf, n);
+    memcpy(sbuf->buf+sbuf->pos, s, n);
+    sbuf->pos += n;
+    sbuf->buf[sbuf->pos] = '\0';
+}
+
+void strbuf_fill(StrBuf *sbuf, int c, int n)
+{
+    strbuf_reserve(sbuf, n);
+    memset(sbuf->buf+sbuf->pos, c, n);
+    sbuf->pos += n;
+    sbuf->buf[sbuf->pos] = '\0';
+}
+
+void strbuf_append_int(StrBuf *sbuf, int i)
+{
+    char tmp[16], *p;
+    unsigned u;
+
+    p = tmp+sizeof(tmp);
+    u = (i<0)?-(unsigned)i:(unsigned)i;
+    do
+        *--p = (char)('0'+u%10);
+    while ((u/=10) != 0);
+    if (i < 0)
+        *--p = '-';
+    strbuf_append(sbuf, p, (int)(tmp+sizeof(tmp)-p));
+}
+
 void strbuf_flush(StrBuf *sbuf)
 {
     fwrite(sbuf->buf, 1, sbuf->pos, stdout);
+    sbuf->base += sbuf->pos;
     sbuf->pos = 0;
+    sbuf->buf[0] = '\0';
+}
+
+/* write the text before position pos and keep the rest */
+void strbuf_flush_to(StrBuf *sbuf, long pos)
+{
+    int n;
+
+    if ((n=(int)(pos-sbuf->base)) <= 0)
+        return;
+    fwrite(sbuf->buf, 1, n, stdout);
+    memmove(sbuf->buf, sbuf->buf+n, sbuf->pos-n+1);
+    sbuf->base += n;
+    sbuf->pos -= n;
 }
 
 void strbuf_clear(StrBuf *sbuf)
 {
     sbuf->pos = 0;
+    sbuf->buf[0] = '\0';
 }
 
 char *strbuf_str(StrBuf *sbuf)
@@ -105,3 +194,175 @@ int strbuf_length(StrBuf *sbuf)
 {
     return sbuf->pos;
 }
+
+/*
+    Ropes. The text lives in an append-only arena and a rope is a tree of
+    (immutable) nodes over it, plus a tail piece that can still grow in
+    place. Appending another rope only adds a node, and a copy of a Rope
+    is a snapshot of its contents.
+*/
+#define ROPE_CHUNK_SIZE 65536
+
+struct RopeNode {
+    RopeNode *left, *right; /* both NULL for a leaf */
+    const char *str;        /* leaf text */
+    int len;
+};
+
+typedef struct RopeChunk RopeChunk;
+static struct RopeChunk {
+    RopeChunk *next;
+    int siz, pos;
+    char *buf;
+} *rope_chunks;
+static int rope_arena_siz;
+
+static void *rope_alloc(int n, int align)
+{
+    RopeChunk *c;
+
+    c = rope_chunks;
+    if (c != NULL)
+        c->pos = (c->pos+align-1) & ~(align-1);
+    if (c==NULL || c->pos+n>c->siz) {
+        c = malloc(sizeof(*c));
+        c->siz = (n > ROPE_CHUNK_SIZE)?n:ROPE_CHUNK_SIZE;
+        c->buf = malloc(c->siz);
+        c->pos = 0;
+        c->next = rope_chunks;
+        rope_chunks = c;
+        rope_arena_siz += c->siz;
+    }
+    c->pos += n;
+    return c->buf+c->pos-n;
+}
+
+static RopeNode *rope_node(RopeNode *left, RopeNode *right, const char *str, int len)
+{
+    RopeNode *n;
+
+    n = rope_alloc(sizeof(*n), sizeof(void *));
+    n->left = left;
+    n->right = right;
+    n->str = str;
+    n->len = len;
+    return n;
+}
+
+/* a node with the whole contents of r (r is left unchanged) */
+static RopeNode *rope_root(Rope *r)
+{
+    RopeNode *t;
+
+    if (r->tail_len == 0)
+        return r->root;
+    t = rope_node(NULL, NULL, r->tail, r->tail_len);
+    return (r->root!=NULL)?rope_node(r->root, t, NULL, r->len):t;
+}
+
+void rope_init(Rope *r)
+{
+    r->root = NULL;
+    r->tail = NULL;
+    r->tail_len = 0;
+    r->len = 0;
+    r->last = -1;
+}
+
+void rope_append(Rope *r, const char *s, int n)
+{
+    RopeChunk *c;
+
+    if (n == 0)
+        return;
+    c = rope_chunks;
+    if (r->tail_len>0 && r->tail+r->tail_len==c->buf+c->pos && c->pos+n<=c->siz) {
+        c->pos += n; /* the tail is at the top of the arena: grow it */
+    } else {
+        r->root = rope_root(r);
+        r->tail = rope_alloc(n, 1);
+        r->tail_len = 0;
+    }
+    memcpy((char *)r->tail+r->tail_len, s, n);
+    r->tail_len += n;
+    r->len += n;
+    r->last = (unsigned char)s[n-1];
+}
+
+void rope_cat(Rope *r, Rope *s)
+{
+    RopeNode *sn;
+
+    if (s->len == 0)
+        return;
+    sn = rope_root(s);
+    r->root = (r->len>0)?rope_node(rope_root(r), sn, NULL, r->len+s->len):sn;
+    r->tail = NULL;
+    r->tail_len = 0;
+    r->len += s->len;
+    r->last = s->last;
+}
+
+static void rope_copy_to(Rope *r, char *dst)
+{
+    static RopeNode **stack;
+    static int stack_siz;
+    RopeNode *n;
+    int sp;
+
+    sp = 0;
+    n = r->root;
+    while (n != NULL) {
+        while (n->left != NULL) {
+            if (sp >= stack_siz) {
+                stack_siz = stack_siz*2+64;
+                stack = realloc(stack, stack_siz*sizeof(*stack));
+            }
+            stack[sp++] = n->right;
+            n = n->left;
+        }
+        memcpy(dst, n->str, n->len);
+        dst += n->len;
+        n = (sp > 0)?stack[--sp]:NULL;
+    }
+    memcpy(dst, r->tail, r->tail_len);
+}
+
+void rope_write(Rope *r, StrBuf *sbuf)
+{
+    strbuf_reserve(sbuf, r->len);
+    rope_copy_to(r, sbuf->buf+sbuf->pos);
+    sbuf->pos += r->len;
+    sbuf->buf[sbuf->pos] = '\0';
+}
+
+int rope_arena_size(void)
+{
+    return rope_arena_siz;
+}
+
+/* copy the ropes in v[0..n-1] to a fresh arena and free the old one */
+void rope_collect(Rope **v, int n)
+{
+    int i;
+    char *s;
+    RopeChunk *c, *old;
+
+    old = rope_chunks;
+    rope_chunks = NULL;
+    rope_arena_siz = 0;
+    for (i = 0; i < n; i++) {
+        if (v[i]->len == 0)
+            continue;
+        s = rope_alloc(v[i]->len, 1);
+        rope_copy_to(v[i], s);
+        v[i]->root = NULL;
+        v[i]->tail = s;
+        v[i]->tail_len = v[i]->len;
+    }
+    for (; old != NULL; old = c) {
+        c = old->next;
+        free(old->buf);
+        free(old);
+    }
+}
@@ -10,16 +10,36 @@
 
 unsigned hash(char *s);
 char *read_file(char *path);
+long count_newlines(const char *s, long n);
 
 typedef struct StrBuf StrBuf;
 StrBuf *strbuf_new(int n);
 void strbuf_destroy(StrBuf *sbuf);
 int strbuf_printf(StrBuf *sbuf, char *fmt, ...);
+void strbuf_append(StrBuf *sbuf, const char *s, int n);
+void strbuf_fill(StrBuf *sbuf, int c, int n);
+void strbuf_append_int(StrBuf *sbuf, int i);
 void strbuf_clear(StrBuf *sbuf);
 void strbuf_flush(StrBuf *sbuf);
-int strbuf_get_pos(StrBuf *sbuf);
-void strbuf_set_pos(StrBuf *sbuf, int pos);
+void strbuf_flush_to(StrBuf *sbuf, long pos);
+long strbuf_get_pos(StrBuf *sbuf);
+void strbuf_set_pos(StrBuf *sbuf, long pos);
 char *strbuf_str(StrBuf *sbuf);
 int strbuf_length(StrBuf *sbuf);
 
+typedef struct RopeNode RopeNode;
+typedef struct Rope {
+    RopeNode *root;     /* everything but the tail */
+    const char *tail;
+    int tail_len;
+    int len;
+    int last;           /* last character, -1 if empty */
+} Rope;
+void rope_init(Rope *r);
+void rope_append(Rope *r, const char *s, int n);
+void rope_cat(Rope *r, Rope *s);
+void rope_write(Rope *r, StrBuf *sbuf);
+int rope_arena_size(void);
+void rope_collect(Rope **v, int n);
+
 #endif